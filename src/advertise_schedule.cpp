@@ -0,0 +1,37 @@
+/*
+ * SPDX-FileCopyrightText: 2025 Taneli Leppä
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+#include "advertise_schedule.h"
+
+namespace improvserver
+{
+
+AdvertiseScheduler::AdvertiseScheduler(uint32_t nameEvery, uint32_t nameFor)
+{
+    nameEveryMsecs = nameEvery;
+    nameForMsecs = nameFor;
+    Reset();
+}
+
+void AdvertiseScheduler::Reset()
+{
+    current = ADV_PAYLOAD_SERVICE;
+    started = false;
+}
+
+adv_slot_t AdvertiseScheduler::Next()
+{
+    if (started && nameForMsecs > 0) {
+        current = current == ADV_PAYLOAD_SERVICE ? ADV_PAYLOAD_NAME : ADV_PAYLOAD_SERVICE;
+    }
+    started = true;
+
+    adv_slot_t slot;
+    slot.payload = current;
+    slot.durationMsecs = current == ADV_PAYLOAD_SERVICE ? nameEveryMsecs : nameForMsecs;
+    return slot;
+}
+
+}
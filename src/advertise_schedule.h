@@ -0,0 +1,49 @@
+/*
+ * SPDX-FileCopyrightText: 2025 Taneli Leppä
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+#ifndef _ADVERTISE_SCHEDULE_H
+#define _ADVERTISE_SCHEDULE_H
+
+#include <stdint.h>
+
+// Rotation between the service UUID and the device name in the advertisement.
+// Kept free of ESP-IDF dependencies so the same scheduler can be run under a
+// virtual clock on the host (see tools/adv_discovery_sim.cpp).
+
+namespace improvserver
+{
+
+#define ADVERTISE_NAME_EVERY_MSECS 5000
+#define ADVERTISE_NAME_FOR_MSECS   1000
+
+enum adv_payload_t : uint8_t {
+    ADV_PAYLOAD_SERVICE = 0,    // service UUID and service data
+    ADV_PAYLOAD_NAME,           // device name and TX power
+};
+
+typedef struct {
+    adv_payload_t payload;
+    uint32_t durationMsecs;
+} adv_slot_t;
+
+class AdvertiseScheduler
+{
+    protected:
+    uint32_t nameEveryMsecs;
+    uint32_t nameForMsecs;
+    adv_payload_t current;
+    bool started;
+
+    public:
+    AdvertiseScheduler(uint32_t nameEvery = ADVERTISE_NAME_EVERY_MSECS, uint32_t nameFor = ADVERTISE_NAME_FOR_MSECS);
+    // Starts over with the service payload
+    void Reset();
+    // Returns what to advertise next and for how long
+    adv_slot_t Next();
+};
+
+}
+#endif
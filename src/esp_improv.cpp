@@ -10,9 +10,22 @@
 #include "services/gap/ble_svc_gap.h"
 #include "nimble/nimble_port.h"
 #include "nimble/nimble_port_freertos.h"
+#include "esp_system.h"
+#include "esp_bt.h"
+#include "esp_timer.h"
+#include "nvs.h"
+#if CONFIG_IMPROV_GATT_CACHING
+#include "mbedtls/cmac.h"
+#endif
+#include "mbedtls/pkcs5.h"
+#include "mbedtls/sha256.h"
+#include "esp_wifi.h"
+#include "esp_netif.h"
 
 #include "esp_central.h"
 
+#include <algorithm>
+
 namespace improvserver 
 {
 
@@ -23,15 +36,27 @@ std::string *ImprovServer::manufacturerName;
 std::string *ImprovServer::modelName; 
 
 bool ImprovServer::advertiseName = false;
+AdvertiseScheduler ImprovServer::scheduler;
 ble_uuid128_t *ImprovServer::serviceUuid = ImprovServer::strToUuid(improv::SERVICE_UUID);
 TaskHandle_t ImprovServer::advertiseTaskHandle = NULL;
+TaskHandle_t ImprovServer::provisionTaskHandle = NULL;
+SemaphoreHandle_t ImprovServer::advertiseExitSem = NULL;
+SemaphoreHandle_t ImprovServer::provisionExitSem = NULL;
+SemaphoreHandle_t ImprovServer::hostExitSem = NULL;
+SemaphoreHandle_t ImprovServer::provisionLock = NULL;
+TimerHandle_t ImprovServer::deadlineTimer = NULL;
+provision_request_t *ImprovServer::pendingRequest = NULL;
+uint32_t ImprovServer::activeAttempt = 0;
+uint32_t ImprovServer::deadlineAttempt = 0;
+bool ImprovServer::attemptFinished = true;
+provisioning_stats_t ImprovServer::provisioningStats = {};
 
 improv::State ImprovServer::state = improv::STATE_AUTHORIZED;
 improv::Error ImprovServer::error = improv::ERROR_NONE;
 
 uint8_t ImprovServer::capabilities = 0;
 uint8_t ImprovServer::addrType = 0;
-uint16_t ImprovServer::connHandle = 0;    
+uint16_t ImprovServer::connHandle = BLE_HS_CONN_HANDLE_NONE;    
 uint16_t ImprovServer::errorHandle = 0;
 uint16_t ImprovServer::statusHandle = 0;
 uint16_t ImprovServer::capabilitiesHandle = 0;
@@ -47,13 +72,64 @@ struct ble_gatt_chr_def ImprovServer::capabilitiesChr;
 struct ble_gatt_chr_def ImprovServer::devManufChr;
 struct ble_gatt_chr_def ImprovServer::devModelChr;
 struct ble_gatt_chr_def ImprovServer::nullChr;
+struct ble_gatt_svc_def *ImprovServer::svcs = NULL;
+struct ble_gatt_svc_def ImprovServer::gattSvc;
+struct ble_gatt_chr_def ImprovServer::svcChangedChr;
+struct ble_gatt_chr_def ImprovServer::dbHashChr;
+uint16_t ImprovServer::svcChangedHandle = 0;
+uint16_t ImprovServer::dbHashHandle = 0;
+uint8_t ImprovServer::dbHash[GATT_DATABASE_HASH_LEN] = {};
+bool ImprovServer::databaseChanged = false;
+int64_t ImprovServer::connectedAt = 0;
+bool ImprovServer::rpcWritten = false;
+session_stats_t ImprovServer::sessionStats = {};
+pmk_stats_t ImprovServer::pmkStats = {};
+provision_timeline_t ImprovServer::timelines[TIMELINE_RING_SIZE];
+size_t ImprovServer::timelineCount = 0;
+portMUX_TYPE ImprovServer::timelineMux = portMUX_INITIALIZER_UNLOCKED;
+TaskHandle_t ImprovServer::pmkTaskHandle = NULL;
+std::vector<wifi_credential_t> ImprovServer::pmkJobs;
+uint32_t ImprovServer::bondClock = 0;
+int64_t ImprovServer::securityStartedAt = 0;
+bool ImprovServer::pairedThisSession = false;
+bond_stats_t ImprovServer::bondStats = {};
 
 bool ImprovServer::advertising = false;
 bool ImprovServer::advertiseOn = false;
+bool ImprovServer::running = false;
+bool ImprovServer::shutdownRequested = false;
+bool ImprovServer::autoShutdown = false;
+bool ImprovServer::autoShutdownReleaseMemory = false;
+bool ImprovServer::controllerMemoryReleased = false;
+shutdown_stats_t ImprovServer::shutdownStats = {};
+shutdown_phase_t ImprovServer::shutdownPhase = SHUTDOWN_IDLE;
+admission_policy_t ImprovServer::admissionPolicy = { 0, ADMISSION_RSSI_DISABLED, NULL, 0 };
+admission_stats_t ImprovServer::admissionStats = {};
+bool ImprovServer::acceptListDirty = false;
+TimerHandle_t ImprovServer::idleTimer = NULL;
+bool ImprovServer::replaying = false;
+replay_context_t ImprovServer::replayCtx;
+int64_t ImprovServer::lastActivityUsecs = 0;
+improv::State ImprovServer::advertisedState = improv::STATE_STOPPED;
+adv_update_stats_t ImprovServer::advUpdateStats = {};
+std::vector<uint8_t> ImprovServer::rpcResult;
+int64_t ImprovServer::virtualNow = 0;
+#if CONFIG_IMPROV_TRACE
+static uint8_t traceBuffer[CONFIG_IMPROV_TRACE_BUFFER_SIZE];
+TraceWriter ImprovServer::traceWriter(traceBuffer, sizeof(traceBuffer));
+// The provisioning task records callback results next to the host task's events
+static portMUX_TYPE traceMux = portMUX_INITIALIZER_UNLOCKED;
+#endif
+#if CONFIG_IMPROV_BONDING
+static bond_entry_t bonds[CONFIG_IMPROV_BOND_STORE_SIZE];
+#endif
 
 esp_err_t ImprovServer::gapEvent(struct ble_gap_event *event, void *arg)
 {
+    uint8_t reason;
+
     ESP_LOGD(TAG, "GAP event: %d", event->type);
+    traceGapEvent(event);
 
     switch (event->type) {
     case BLE_GAP_EVENT_CONNECT:
@@ -64,20 +140,53 @@ esp_err_t ImprovServer::gapEvent(struct ble_gap_event *event, void *arg)
 
         if (event->connect.status != 0) {
             /* Connection failed; resume advertising */
-            ImprovServer::connHandle = 0;
+            ImprovServer::connHandle = BLE_HS_CONN_HANDLE_NONE;
             ImprovServer::state = improv::STATE_AUTHORIZED;
             ImprovServer::error = improv::ERROR_NONE;
             advertise();
+        } else if (ImprovServer::connHandle != BLE_HS_CONN_HANDLE_NONE) {
+            /* Only one Improv session at a time */
+            ESP_LOGW(TAG, "already serving handle=%d, rejecting handle=%d", ImprovServer::connHandle, event->connect.conn_handle);
+            admissionStats.busyRejections++;
+            rejectClient(event->connect.conn_handle, BLE_ERR_REM_USER_CONN_TERM);
+        } else if (!admitClient(event->connect.conn_handle, &reason)) {
+            rejectClient(event->connect.conn_handle, reason);
         } else {
             ImprovServer::connHandle = event->connect.conn_handle;
             ImprovServer::state = improv::STATE_AUTHORIZED;
             ImprovServer::error = improv::ERROR_NONE;
+            admissionStats.accepted++;
+            sessionStats.sessions++;
+            connectedAt = now();
+            rpcWritten = false;
+            rpcResult.clear();
+            clientActivity();
+            /* Keep advertising the state, but don't accept further connections */
             advertise();
+#if CONFIG_IMPROV_BONDING
+            /* Ask for encryption right away instead of failing the first RPC write:
+             * a bonded station resumes with its stored key, others pair */
+            pairedThisSession = false;
+            securityStartedAt = now();
+            if (!replaying) {
+                int rc = ble_gap_security_initiate(ImprovServer::connHandle);
+                if (rc != 0 && rc != BLE_HS_EALREADY) {
+                    ESP_LOGW(TAG, "Failed to request security, rc=%d", rc);
+                }
+            }
+#endif
         }
         break;
     case BLE_GAP_EVENT_DISCONNECT:
         ESP_LOGI(TAG, "disconnect; reason=%d", event->disconnect.reason);
-        ImprovServer::connHandle = 0;
+        if (event->disconnect.conn.conn_handle != ImprovServer::connHandle) {
+            /* A rejected client */
+            break;
+        }
+        ImprovServer::connHandle = BLE_HS_CONN_HANDLE_NONE;
+        if (idleTimer != NULL && !replaying) {
+            xTimerStop(idleTimer, 0);
+        }
         /* Connection terminated; resume advertising */
         advertise();
         break;
@@ -89,24 +198,55 @@ esp_err_t ImprovServer::gapEvent(struct ble_gap_event *event, void *arg)
 
     case BLE_GAP_EVENT_SUBSCRIBE:
         ESP_LOGI(TAG, "subscribe event attr_handle=%d", event->subscribe.attr_handle);
+        if (event->subscribe.conn_handle == ImprovServer::connHandle) {
+            clientActivity();
+        }
+#if CONFIG_IMPROV_GATT_CACHING
+        if (event->subscribe.attr_handle == svcChangedHandle && event->subscribe.cur_indicate) {
+            serviceChangedSubscribed(event->subscribe.conn_handle);
+        }
+#endif
         break;
 
     case BLE_GAP_EVENT_MTU:
         ESP_LOGI(TAG, "MTU update event; conn_handle=%d mtu=%d\n", event->mtu.conn_handle, event->mtu.value);
         break;
 
+#if CONFIG_IMPROV_GATT_CACHING
+    case BLE_GAP_EVENT_NOTIFY_TX:
+        if (event->notify_tx.indication && event->notify_tx.attr_handle == svcChangedHandle &&
+            event->notify_tx.status == BLE_HS_EDONE) {
+            serviceChangedConfirmed();
+        }
+        break;
+#endif
+
+#if CONFIG_IMPROV_BONDING
+    case BLE_GAP_EVENT_ENC_CHANGE:
+        ESP_LOGI(TAG, "encryption change; status=%d", event->enc_change.status);
+        if (event->enc_change.conn_handle == ImprovServer::connHandle) {
+            securityChanged(event->enc_change.conn_handle, event->enc_change.status);
+        }
+        break;
+
+    case BLE_GAP_EVENT_REPEAT_PAIRING: {
+        /* The station lost its keys but we still have a bond: drop ours and pair again */
+        struct ble_gap_conn_desc desc;
+        if (!replaying && ble_gap_conn_find(event->repeat_pairing.conn_handle, &desc) == 0) {
+            ble_store_util_delete_peer(&desc.peer_id_addr);
+        }
+        return BLE_GAP_REPEAT_PAIRING_RETRY;
+    }
+#endif
+
     }
     return ESP_OK;
 }
 
-esp_err_t ImprovServer::advertise()
+int ImprovServer::setAdvertisingFields()
 {
-    struct ble_gap_adv_params adv_params;
     struct ble_hs_adv_fields fields;
-    int rc;
-
-    ESP_LOGD(TAG, "Advertising...");
-    advertising = true;
+    uint8_t service_data[8] = {};
 
     memset(&fields, 0, sizeof(fields));
 
@@ -125,23 +265,84 @@ esp_err_t ImprovServer::advertise()
         fields.num_uuids128 = 1; 
         fields.uuids128_is_complete = 0;
 
-        uint8_t service_data[8] = {};
         service_data[0] = 0x77;  // PR
         service_data[1] = 0x46;  // IM
         service_data[2] = static_cast<uint8_t>(state);
+        service_data[3] = capabilities;
         fields.svc_data_uuid16 = (const uint8_t *)&service_data;
         fields.svc_data_uuid16_len = 8;
     }
-  
-    rc = ble_gap_adv_set_fields(&fields);
+    advertisedState = state;
+    return ble_gap_adv_set_fields(&fields);
+}
+
+// Refreshes the state in the advertising data while advertising continues
+void ImprovServer::updateAdvertisingData()
+{
+    if (replaying || !advertising || !ble_gap_adv_active()) {
+        return;
+    }
+    if (advertiseName || state == advertisedState) {
+        // The name advertisement carries no state, the next service data advertisement picks it up
+        if (state != advertisedState) {
+            advUpdateStats.deferred++;
+        }
+        return;
+    }
+
+    int64_t start = now();
+    int rc = setAdvertisingFields();
+    if (rc != 0) {
+        ESP_LOGW(TAG, "error updating advertisement data; rc=%d", rc);
+        return;
+    }
+    int64_t latency = now() - start;
+    advUpdateStats.updates++;
+    advUpdateStats.lastLatencyUsecs = latency;
+    if (latency > advUpdateStats.maxLatencyUsecs) {
+        advUpdateStats.maxLatencyUsecs = latency;
+    }
+}
+
+esp_err_t ImprovServer::advertise()
+{
+    struct ble_gap_adv_params adv_params;
+    int rc;
+
+    if (replaying) {
+        return ESP_OK;
+    }
+
+    ESP_LOGD(TAG, "Advertising...");
+    advertising = true;
+
+    if (ble_gap_adv_active()) {
+        // Connectable mode may change, so advertising has to be restarted
+        ble_gap_adv_stop();
+    }
+
+    rc = setAdvertisingFields();
     if (rc != 0) {
         ESP_LOGE(TAG, "error setting advertisement data; rc=%d\n", rc);
         return ESP_FAIL;
     }
 
+    if (acceptListDirty && admissionPolicy.acceptListLen > 0) {
+        rc = ble_gap_wl_set(admissionPolicy.acceptList, admissionPolicy.acceptListLen);
+        if (rc != 0) {
+            ESP_LOGE(TAG, "error setting filter accept list; rc=%d\n", rc);
+        } else {
+            acceptListDirty = false;
+        }
+    }
+
     memset(&adv_params, 0, sizeof(adv_params));
-    adv_params.conn_mode = BLE_GAP_CONN_MODE_UND;
+    adv_params.conn_mode = connHandle != BLE_HS_CONN_HANDLE_NONE ? BLE_GAP_CONN_MODE_NON : BLE_GAP_CONN_MODE_UND;
     adv_params.disc_mode = BLE_GAP_DISC_MODE_GEN;
+    if (admissionPolicy.acceptListLen > 0) {
+        // Anyone may scan, only stations on the accept list may connect
+        adv_params.filter_policy = BLE_HCI_ADV_FILT_CONN;
+    }
     //adv_params.itvl_min = BLE_GAP_ADV_ITVL_MS(500);
     //adv_params.itvl_max = BLE_GAP_ADV_ITVL_MS(600);
     rc = ble_gap_adv_start(BLE_OWN_ADDR_PUBLIC, NULL, BLE_HS_FOREVER,
@@ -153,6 +354,683 @@ esp_err_t ImprovServer::advertise()
     return ESP_OK;
 }
 
+// On rejection *reason is the disconnect reason; HCI Disconnect only accepts a few
+bool ImprovServer::admitClient(uint16_t handle, uint8_t *reason)
+{
+    struct ble_gap_conn_desc desc;
+    int rc;
+
+    *reason = BLE_ERR_REM_USER_CONN_TERM;
+    if (admissionPolicy.acceptListLen > 0) {
+        if (!findConn(handle, &desc)) {
+            return false;
+        }
+        bool found = false;
+        for (size_t i = 0; i < admissionPolicy.acceptListLen; i++) {
+            if (memcmp(&admissionPolicy.acceptList[i], &desc.peer_id_addr, sizeof(ble_addr_t)) == 0) {
+                found = true;
+                break;
+            }
+        }
+        if (!found) {
+            ESP_LOGW(TAG, "rejecting %s, not on accept list", addr_str(desc.peer_id_addr.val));
+            admissionStats.acceptListRejections++;
+            *reason = BLE_ERR_AUTH_FAIL;
+            return false;
+        }
+    }
+
+    if (admissionPolicy.minRssi != ADMISSION_RSSI_DISABLED) {
+        int8_t rssi = 0;
+        rc = connRssi(handle, &rssi);
+        if (rc == 0 && rssi < admissionPolicy.minRssi) {
+            ESP_LOGW(TAG, "rejecting handle=%d, rssi=%d below %d", handle, rssi, admissionPolicy.minRssi);
+            admissionStats.rssiRejections++;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Drops a client that wasn't admitted and keeps advertising for the next one
+void ImprovServer::rejectClient(uint16_t handle, uint8_t reason)
+{
+    int rc = terminateConn(handle, reason);
+    if (rc != 0) {
+        ESP_LOGW(TAG, "Failed to disconnect handle=%d, rc=%d", handle, rc);
+    }
+    advertise();
+}
+
+// Called when the client subscribes or writes an RPC, restarts the idle timer
+void ImprovServer::clientActivity()
+{
+    lastActivityUsecs = now();
+    if (replaying) {
+        replayCtx.idleArmed = true;
+    } else if (idleTimer != NULL && admissionPolicy.idleTimeoutMsecs > 0) {
+        xTimerReset(idleTimer, 0);
+    }
+}
+
+void ImprovServer::idleTimerCallback(TimerHandle_t timer)
+{
+    uint16_t handle = connHandle;
+
+    if (handle == BLE_HS_CONN_HANDLE_NONE) {
+        return;
+    }
+    if (state == improv::STATE_PROVISIONING) {
+        // Client is waiting for the result, check again later
+        if (!replaying) {
+            xTimerReset(idleTimer, 0);
+        }
+        return;
+    }
+    ESP_LOGI(TAG, "Client idle for %u ms, disconnecting handle=%d", (unsigned)admissionPolicy.idleTimeoutMsecs, handle);
+    admissionStats.idleEvictions++;
+    int rc = terminateConn(handle, BLE_ERR_REM_USER_CONN_TERM);
+    if (rc != 0) {
+        ESP_LOGW(TAG, "Failed to disconnect idle client, rc=%d", rc);
+    }
+}
+
+esp_err_t ImprovServer::SetAdmissionPolicy(const admission_policy_t *policy)
+{
+    if (policy == NULL || (policy->acceptListLen > 0 && policy->acceptList == NULL)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    // ble_gap_wl_set() takes an 8-bit count
+    if (policy->acceptListLen > UINT8_MAX) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    delete[] admissionPolicy.acceptList;
+    admissionPolicy = *policy;
+    admissionPolicy.acceptList = NULL;
+    if (policy->acceptListLen > 0) {
+        ble_addr_t *acceptList = new ble_addr_t[policy->acceptListLen];
+        memcpy(acceptList, policy->acceptList, policy->acceptListLen * sizeof(ble_addr_t));
+        admissionPolicy.acceptList = acceptList;
+    }
+    // Without an accept list the filter policy is off and the controller list isn't used
+    acceptListDirty = admissionPolicy.acceptListLen > 0;
+
+    if (admissionPolicy.idleTimeoutMsecs > 0) {
+        if (idleTimer == NULL) {
+            idleTimer = xTimerCreate("improv_idle", pdMS_TO_TICKS(admissionPolicy.idleTimeoutMsecs), pdFALSE, NULL, ImprovServer::idleTimerCallback);
+            if (idleTimer == NULL) {
+                return ESP_ERR_NO_MEM;
+            }
+        } else {
+            xTimerChangePeriod(idleTimer, pdMS_TO_TICKS(admissionPolicy.idleTimeoutMsecs), 0);
+            if (connHandle == BLE_HS_CONN_HANDLE_NONE) {
+                xTimerStop(idleTimer, 0);
+            }
+        }
+    } else if (idleTimer != NULL) {
+        xTimerStop(idleTimer, 0);
+    }
+    return ESP_OK;
+}
+
+admission_stats_t ImprovServer::GetAdmissionStats()
+{
+    return admissionStats;
+}
+
+int64_t ImprovServer::now()
+{
+    return replaying ? virtualNow : esp_timer_get_time();
+}
+
+void ImprovServer::traceRecord(uint8_t type, uint16_t conn, uint16_t attr, const uint8_t *payload, size_t len)
+{
+#if CONFIG_IMPROV_TRACE
+    if (replaying) {
+        return;
+    }
+    trace_record_t rec = { type, conn, attr, 0, payload, len };
+    // Stamped under the lock so records from both tasks go in in time order
+    portENTER_CRITICAL(&traceMux);
+    rec.timestampUsecs = now();
+    traceWriter.Append(&rec);
+    portEXIT_CRITICAL(&traceMux);
+#endif
+}
+
+void ImprovServer::traceGapEvent(struct ble_gap_event *event)
+{
+#if CONFIG_IMPROV_TRACE
+    uint8_t payload[14];
+    struct ble_gap_conn_desc desc;
+
+    if (replaying) {
+        return;
+    }
+    switch (event->type) {
+    case BLE_GAP_EVENT_CONNECT: {
+        // Admission looks at the peer and its RSSI, keep what it would have seen
+        int8_t rssi = 0;
+        memcpy(payload, &event->connect.status, sizeof(int32_t));
+        if (event->connect.status != 0 || ble_gap_conn_find(event->connect.conn_handle, &desc) != 0) {
+            traceRecord(TRACE_GAP_CONNECT, event->connect.conn_handle, 0, payload, sizeof(int32_t));
+            break;
+        }
+        payload[4] = desc.peer_id_addr.type;
+        memcpy(payload + 5, desc.peer_id_addr.val, sizeof(desc.peer_id_addr.val));
+        payload[12] = ble_gap_conn_rssi(event->connect.conn_handle, &rssi) == 0;
+        payload[11] = rssi;
+        traceRecord(TRACE_GAP_CONNECT, event->connect.conn_handle, 0, payload, 13);
+        break;
+    }
+    case BLE_GAP_EVENT_DISCONNECT:
+        memcpy(payload, &event->disconnect.reason, sizeof(int32_t));
+        traceRecord(TRACE_GAP_DISCONNECT, event->disconnect.conn.conn_handle, 0, payload, sizeof(int32_t));
+        break;
+    case BLE_GAP_EVENT_ADV_COMPLETE:
+        memcpy(payload, &event->adv_complete.reason, sizeof(int32_t));
+        traceRecord(TRACE_GAP_ADV_COMPLETE, 0, 0, payload, sizeof(int32_t));
+        break;
+    case BLE_GAP_EVENT_SUBSCRIBE:
+        payload[0] = event->subscribe.reason;
+        payload[1] = event->subscribe.cur_notify;
+        payload[2] = event->subscribe.cur_indicate;
+        traceRecord(TRACE_GAP_SUBSCRIBE, event->subscribe.conn_handle, event->subscribe.attr_handle, payload, 3);
+        break;
+    case BLE_GAP_EVENT_MTU:
+        payload[0] = event->mtu.value & 0xff;
+        payload[1] = event->mtu.value >> 8;
+        traceRecord(TRACE_GAP_MTU, event->mtu.conn_handle, 0, payload, 2);
+        break;
+    case BLE_GAP_EVENT_ENC_CHANGE:
+        // The handler looks the link up, so keep what it would have found
+        memcpy(payload, &event->enc_change.status, sizeof(int32_t));
+        if (ble_gap_conn_find(event->enc_change.conn_handle, &desc) != 0) {
+            traceRecord(TRACE_GAP_ENC_CHANGE, event->enc_change.conn_handle, 0, payload, sizeof(int32_t));
+            break;
+        }
+        payload[4] = desc.sec_state.encrypted;
+        payload[5] = desc.sec_state.bonded;
+        payload[6] = desc.peer_id_addr.type;
+        memcpy(payload + 7, desc.peer_id_addr.val, sizeof(desc.peer_id_addr.val));
+        // Pairing vs resumption hinges on the store writes, which aren't traced
+        payload[13] = pairedThisSession;
+        traceRecord(TRACE_GAP_ENC_CHANGE, event->enc_change.conn_handle, 0, payload, 14);
+        break;
+    case BLE_GAP_EVENT_REPEAT_PAIRING:
+        traceRecord(TRACE_GAP_REPEAT_PAIRING, event->repeat_pairing.conn_handle, 0, NULL, 0);
+        break;
+    case BLE_GAP_EVENT_NOTIFY_TX:
+        // Status notifications would fill the buffer; only Service Changed is indicated
+        if (!event->notify_tx.indication) {
+            break;
+        }
+        memcpy(payload, &event->notify_tx.status, sizeof(int32_t));
+        payload[4] = 1;
+        traceRecord(TRACE_GAP_NOTIFY_TX, event->notify_tx.conn_handle, event->notify_tx.attr_handle, payload, 5);
+        break;
+    }
+#endif
+}
+
+void ImprovServer::traceGattAccess(trace_chr_t chr, uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt)
+{
+#if CONFIG_IMPROV_TRACE
+    // Only called from the host task, keep the buffer off its stack
+    static uint8_t payload[2 + TRACE_MAX_WRITE_LEN];
+    uint16_t copied = 0;
+
+    payload[0] = chr;
+    payload[1] = ctxt->op;
+    if (ctxt->op == BLE_GATT_ACCESS_OP_WRITE_CHR) {
+        ble_hs_mbuf_to_flat(ctxt->om, payload + 2, TRACE_MAX_WRITE_LEN, &copied);
+    }
+    traceRecord(TRACE_GATT_ACCESS, conn_handle, attr_handle, payload, 2 + copied);
+#endif
+}
+
+bool ImprovServer::replayGapEvent(const trace_record_t *rec)
+{
+    struct ble_gap_event event;
+    int32_t value = 0;
+
+    memset(&event, 0, sizeof(event));
+    memset(&replayCtx.connDesc, 0, sizeof(replayCtx.connDesc));
+    replayCtx.connFound = false;
+    replayCtx.rssiFound = false;
+    if (rec->payloadLen >= sizeof(int32_t)) {
+        memcpy(&value, rec->payload, sizeof(int32_t));
+    }
+    switch (rec->type) {
+    case TRACE_GAP_CONNECT:
+        event.type = BLE_GAP_EVENT_CONNECT;
+        event.connect.status = value;
+        event.connect.conn_handle = rec->connHandle;
+        if (rec->payloadLen >= 13) {
+            replayCtx.connFound = true;
+            replayCtx.connDesc.conn_handle = rec->connHandle;
+            replayCtx.connDesc.peer_id_addr.type = rec->payload[4];
+            memcpy(replayCtx.connDesc.peer_id_addr.val, rec->payload + 5, sizeof(replayCtx.connDesc.peer_id_addr.val));
+            replayCtx.rssi = (int8_t)rec->payload[11];
+            replayCtx.rssiFound = rec->payload[12];
+        }
+        break;
+    case TRACE_GAP_DISCONNECT:
+        event.type = BLE_GAP_EVENT_DISCONNECT;
+        event.disconnect.reason = value;
+        event.disconnect.conn.conn_handle = rec->connHandle;
+        break;
+    case TRACE_GAP_ADV_COMPLETE:
+        event.type = BLE_GAP_EVENT_ADV_COMPLETE;
+        event.adv_complete.reason = value;
+        break;
+    case TRACE_GAP_SUBSCRIBE:
+        if (rec->payloadLen < 3) {
+            return false;
+        }
+        event.type = BLE_GAP_EVENT_SUBSCRIBE;
+        event.subscribe.conn_handle = rec->connHandle;
+        event.subscribe.attr_handle = rec->attrHandle;
+        event.subscribe.reason = rec->payload[0];
+        event.subscribe.cur_notify = rec->payload[1];
+        event.subscribe.cur_indicate = rec->payload[2];
+        break;
+    case TRACE_GAP_MTU:
+        if (rec->payloadLen < 2) {
+            return false;
+        }
+        event.type = BLE_GAP_EVENT_MTU;
+        event.mtu.conn_handle = rec->connHandle;
+        event.mtu.value = rec->payload[0] | (rec->payload[1] << 8);
+        break;
+    case TRACE_GAP_ENC_CHANGE:
+        event.type = BLE_GAP_EVENT_ENC_CHANGE;
+        event.enc_change.status = value;
+        event.enc_change.conn_handle = rec->connHandle;
+        if (rec->payloadLen >= 13) {
+            replayCtx.connFound = true;
+            replayCtx.connDesc.conn_handle = rec->connHandle;
+            replayCtx.connDesc.sec_state.encrypted = rec->payload[4];
+            replayCtx.connDesc.sec_state.bonded = rec->payload[5];
+            replayCtx.connDesc.peer_id_addr.type = rec->payload[6];
+            memcpy(replayCtx.connDesc.peer_id_addr.val, rec->payload + 7, sizeof(replayCtx.connDesc.peer_id_addr.val));
+        }
+        if (rec->payloadLen >= 14) {
+            // Replays don't write the key store, take the captured outcome
+            pairedThisSession = rec->payload[13];
+        }
+        break;
+    case TRACE_GAP_REPEAT_PAIRING:
+        event.type = BLE_GAP_EVENT_REPEAT_PAIRING;
+        event.repeat_pairing.conn_handle = rec->connHandle;
+        break;
+    case TRACE_GAP_NOTIFY_TX:
+        if (rec->payloadLen < 5) {
+            return false;
+        }
+        event.type = BLE_GAP_EVENT_NOTIFY_TX;
+        event.notify_tx.conn_handle = rec->connHandle;
+        event.notify_tx.attr_handle = rec->attrHandle;
+        event.notify_tx.status = value;
+        event.notify_tx.indication = rec->payload[4];
+        break;
+    default:
+        return false;
+    }
+    gapEvent(&event, NULL);
+    replayCtx.connFound = false;
+    replayCtx.rssiFound = false;
+    return true;
+}
+
+// Looks up a link, or during a replay the link as it was when the event was captured
+bool ImprovServer::findConn(uint16_t conn_handle, struct ble_gap_conn_desc *desc)
+{
+    if (replaying) {
+        if (!replayCtx.connFound || replayCtx.connDesc.conn_handle != conn_handle) {
+            return false;
+        }
+        *desc = replayCtx.connDesc;
+        return true;
+    }
+    return ble_gap_conn_find(conn_handle, desc) == 0;
+}
+
+int ImprovServer::connRssi(uint16_t conn_handle, int8_t *rssi)
+{
+    if (replaying) {
+        if (!replayCtx.rssiFound || replayCtx.connDesc.conn_handle != conn_handle) {
+            return BLE_HS_ENOTCONN;
+        }
+        *rssi = replayCtx.rssi;
+        return 0;
+    }
+    return ble_gap_conn_rssi(conn_handle, rssi);
+}
+
+// Drops a link. A replay has no link to drop, so the link is marked as gone and
+// gets the disconnect NimBLE would report; the rest of it in the capture is skipped
+int ImprovServer::terminateConn(uint16_t conn_handle, uint8_t reason)
+{
+    struct ble_gap_event event;
+
+    if (!replaying) {
+        return ble_gap_terminate(conn_handle, reason);
+    }
+    replayCtx.terminated.push_back(conn_handle);
+    memset(&event, 0, sizeof(event));
+    event.type = BLE_GAP_EVENT_DISCONNECT;
+    event.disconnect.reason = BLE_HS_HCI_ERR(reason);
+    event.disconnect.conn.conn_handle = conn_handle;
+    gapEvent(&event, NULL);
+    return 0;
+}
+
+// True if the record belongs to a link the replay already dropped
+bool ImprovServer::replayTerminated(const trace_record_t *rec)
+{
+    for (size_t i = 0; i < replayCtx.terminated.size(); i++) {
+        if (replayCtx.terminated[i] != rec->connHandle) {
+            continue;
+        }
+        if (rec->type == TRACE_GAP_DISCONNECT) {
+            // The handle may be reused after this
+            replayCtx.terminated.erase(replayCtx.terminated.begin() + i);
+        }
+        return true;
+    }
+    return false;
+}
+
+// The idle timer doesn't run during a replay, evict on the virtual clock instead
+void ImprovServer::replayIdleTimer(int64_t until)
+{
+    int64_t timeout = (int64_t)admissionPolicy.idleTimeoutMsecs * 1000;
+
+    while (replayCtx.idleArmed && connHandle != BLE_HS_CONN_HANDLE_NONE && timeout > 0) {
+        int64_t fire = lastActivityUsecs + timeout;
+        if (fire < virtualNow) {
+            // The stub provisioner moved the clock on, the timer kept re-arming meanwhile
+            fire += (virtualNow - fire + timeout - 1) / timeout * timeout;
+        }
+        if (until < fire) {
+            break;
+        }
+        virtualNow = fire;
+        lastActivityUsecs = virtualNow;
+        // One-shot like the live timer, which only re-arms itself while provisioning
+        replayCtx.idleArmed = state == improv::STATE_PROVISIONING;
+        idleTimerCallback(idleTimer);
+    }
+}
+
+bool ImprovServer::replayScan(int8_t *rssi, size_t count, esp_err_t *err)
+{
+    for (size_t i = 0; i < replayCtx.outcomes.size(); i++) {
+        const trace_record_t *rec = &replayCtx.outcomes[i];
+        uint32_t attempt;
+
+        if (replayCtx.consumed[i] || rec->type != TRACE_PROVISION_SCAN) {
+            continue;
+        }
+        memcpy(&attempt, rec->payload, sizeof(attempt));
+        if (attempt != replayCtx.attempt) {
+            continue;
+        }
+        replayCtx.consumed[i] = true;
+        memcpy(err, rec->payload + 4, sizeof(esp_err_t));
+        for (size_t j = 0; j < count && 8 + j < rec->payloadLen; j++) {
+            rssi[j] = (int8_t)rec->payload[8 + j];
+        }
+        virtualNow = std::max(virtualNow, rec->timestampUsecs);
+        return true;
+    }
+    return false;
+}
+
+// Stub provisioner: returns what the app's callback returned for this network in the capture
+bool ImprovServer::replayProvisioning(const provision_token_t *token, const wifi_credential_t *cred, esp_err_t *err)
+{
+    for (size_t i = 0; i < replayCtx.outcomes.size(); i++) {
+        const trace_record_t *rec = &replayCtx.outcomes[i];
+        uint32_t attempt;
+
+        if (replayCtx.consumed[i] || rec->type != TRACE_PROVISION_RESULT) {
+            continue;
+        }
+        memcpy(&attempt, rec->payload, sizeof(attempt));
+        if (attempt != replayCtx.attempt) {
+            continue;
+        }
+        replayCtx.consumed[i] = true;
+        if (rec->payload[4] != cred->index) {
+            ESP_LOGW(TAG, "Replay diverged: network %d tried, capture has %d", cred->index, rec->payload[4]);
+        }
+        memcpy(err, rec->payload + 5, sizeof(esp_err_t));
+        virtualNow = std::max(virtualNow, rec->timestampUsecs);
+        if (now() >= token->deadlineUsecs) {
+            // The deadline timer fired while the callback ran
+            finishAttempt(token->attempt, ESP_ERR_TIMEOUT, NULL, false);
+        }
+        return true;
+    }
+
+    // Either superseded before the callback ran, or it hadn't returned when the
+    // capture ended; only in the latter case can the deadline have fired
+    bool laterSubmits = !replayCtx.submits.empty() && replayCtx.submits.back().first > replayCtx.record;
+    if (!laterSubmits && replayCtx.endUsecs >= token->deadlineUsecs) {
+        virtualNow = std::max(virtualNow, token->deadlineUsecs);
+        finishAttempt(token->attempt, ESP_ERR_TIMEOUT, NULL, false);
+    }
+    return false;
+}
+
+bool ImprovServer::replayGattAccess(const trace_record_t *rec)
+{
+    struct ble_gatt_access_ctxt ctxt;
+    const struct ble_gatt_chr_def *chr;
+
+    if (rec->payloadLen < 2) {
+        return false;
+    }
+    switch (rec->payload[0]) {
+    case TRACE_CHR_STATUS:
+    case TRACE_CHR_ERROR:
+    case TRACE_CHR_RPC_WRITE:
+    case TRACE_CHR_RPC_RESULT:
+    case TRACE_CHR_CAPABILITIES:
+        // Same order as the Improv service table in initServer()
+        chr = &svc.characteristics[rec->payload[0] - TRACE_CHR_STATUS];
+        break;
+    case TRACE_CHR_MANUFACTURER:
+        chr = &devSvc.characteristics[0];
+        break;
+    case TRACE_CHR_MODEL:
+        chr = &devSvc.characteristics[1];
+        break;
+#if CONFIG_IMPROV_GATT_CACHING
+    case TRACE_CHR_SVC_CHANGED:
+    case TRACE_CHR_DB_HASH:
+        // Same order as the Generic Attribute service table in initServer()
+        chr = &gattSvc.characteristics[rec->payload[0] - TRACE_CHR_SVC_CHANGED];
+        break;
+#endif
+    default:
+        return false;
+    }
+
+    memset(&ctxt, 0, sizeof(ctxt));
+    ctxt.op = rec->payload[1];
+    ctxt.chr = chr;
+    ctxt.om = ble_hs_mbuf_from_flat(rec->payload + 2, rec->payloadLen - 2);
+    if (ctxt.om == NULL) {
+        return false;
+    }
+    chr->access_cb(rec->connHandle, rec->attrHandle, &ctxt, chr->arg);
+    os_mbuf_free_chain(ctxt.om);
+    return true;
+}
+
+esp_err_t ImprovServer::GetTrace(const uint8_t **capture, size_t *len, uint32_t *dropped)
+{
+#if CONFIG_IMPROV_TRACE
+    if (capture == NULL || len == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    *capture = traceWriter.Data();
+    *len = traceWriter.Length();
+    if (dropped != NULL) {
+        *dropped = traceWriter.Dropped();
+    }
+    return ESP_OK;
+#else
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+esp_err_t ImprovServer::ClearTrace()
+{
+#if CONFIG_IMPROV_TRACE
+    traceWriter.Clear();
+    return ESP_OK;
+#else
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+esp_err_t ImprovServer::Replay(const uint8_t *capture, size_t len, trace_replay_stats_t *stats)
+{
+    trace_record_t rec;
+    int64_t first = -1;
+
+    if (capture == NULL || stats == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    TraceReader reader(capture, len);
+    if (!reader.Valid()) {
+        ESP_LOGE(TAG, "Not a valid trace capture!");
+        return ESP_ERR_INVALID_ARG;
+    }
+    // Needs the NimBLE mbuf pools, but no live client, advertising or attempt in the way.
+    // The advertise task only stops advertising at its next wakeup after advertiseOn
+    // is cleared, a central could still connect until then
+    if (!running || advertiseOn || advertising || ble_gap_adv_active() || connHandle != BLE_HS_CONN_HANDLE_NONE ||
+        !attemptFinished) {
+        ESP_LOGE(TAG, "Stop advertising and disconnect clients before replaying!");
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    // Scan and callback results are fed back by the stub provisioner when the
+    // request they belong to runs, which replays do when it is submitted. A
+    // request is submitted by the RPC write handler, so the submit record
+    // follows the write that made it
+    replayCtx = replay_context_t();
+    size_t index = 0, lastWrite = SIZE_MAX;
+    for (; reader.Next(&rec); index++) {
+        if (rec.type == TRACE_GATT_ACCESS && rec.payloadLen >= 2 && rec.payload[0] == TRACE_CHR_RPC_WRITE) {
+            lastWrite = index;
+        } else if (rec.type == TRACE_PROVISION_SUBMIT && rec.payloadLen >= 4 && lastWrite != SIZE_MAX) {
+            uint32_t attempt;
+            memcpy(&attempt, rec.payload, sizeof(attempt));
+            replayCtx.submits.push_back(std::make_pair(lastWrite, attempt));
+            lastWrite = SIZE_MAX;
+        } else if ((rec.type == TRACE_PROVISION_SCAN && rec.payloadLen >= 8) ||
+            (rec.type == TRACE_PROVISION_RESULT && rec.payloadLen >= 9)) {
+            replayCtx.outcomes.push_back(rec);
+        }
+        replayCtx.endUsecs = rec.timestampUsecs;
+    }
+    replayCtx.consumed.assign(replayCtx.outcomes.size(), false);
+    reader = TraceReader(capture, len);
+
+    // The replay counts into fresh stats and timelines, the live ones are put back after
+    improv::State liveState = state;
+    improv::Error liveError = error;
+    provisioning_stats_t liveProvisioning = provisioningStats;
+    admission_stats_t liveAdmission = admissionStats;
+    session_stats_t liveSessions = sessionStats;
+    pmk_stats_t livePmk = pmkStats;
+    bond_stats_t liveBonds = bondStats;
+    std::vector<provision_timeline_t> liveTimelines(timelines, timelines + TIMELINE_RING_SIZE);
+    size_t liveTimelineCount = timelineCount;
+    provisioningStats = provisioning_stats_t();
+    admissionStats = admission_stats_t();
+    sessionStats = session_stats_t();
+    pmkStats = pmk_stats_t();
+    bondStats = bond_stats_t();
+    bondStats.bonds = liveBonds.bonds;
+    portENTER_CRITICAL(&timelineMux);
+    timelineCount = 0;
+    portEXIT_CRITICAL(&timelineMux);
+
+    memset(stats, 0, sizeof(trace_replay_stats_t));
+    state = improv::STATE_AUTHORIZED;
+    error = improv::ERROR_NONE;
+    replaying = true;
+    size_t heapBefore = esp_get_free_heap_size();
+    for (index = 0; reader.Next(&rec); index++) {
+        if (first < 0) {
+            first = rec.timestampUsecs;
+        }
+        stats->virtualDurationUsecs = rec.timestampUsecs - first;
+        replayCtx.record = index;
+        if (rec.type == TRACE_PROVISION_SUBMIT || rec.type == TRACE_PROVISION_SCAN || rec.type == TRACE_PROVISION_RESULT) {
+            continue;
+        }
+        int64_t start = esp_timer_get_time();
+        replayIdleTimer(rec.timestampUsecs);
+        virtualNow = rec.timestampUsecs;
+        bool handled = false;
+        if (!replayTerminated(&rec)) {
+            handled = rec.type == TRACE_GATT_ACCESS ? replayGattAccess(&rec) : replayGapEvent(&rec);
+        }
+        stats->handlerUsecs += esp_timer_get_time() - start;
+        if (handled) {
+            stats->events++;
+        } else {
+            stats->skipped++;
+        }
+    }
+    for (bool consumed : replayCtx.consumed) {
+        if (consumed) {
+            stats->callbacks++;
+        } else {
+            stats->skipped++;
+        }
+    }
+    stats->freeHeapDelta = (int32_t)esp_get_free_heap_size() - (int32_t)heapBefore;
+    stats->finalState = state;
+    stats->finalError = error;
+    stats->provisioning = provisioningStats;
+    stats->admission = admissionStats;
+    stats->sessions = sessionStats;
+    stats->pmk = pmkStats;
+    stats->bonds = bondStats;
+    replaying = false;
+
+    // Don't leave the replayed session or an attempt it left in flight behind
+    connHandle = BLE_HS_CONN_HANDLE_NONE;
+    state = liveState;
+    error = liveError;
+    attemptFinished = true;
+    replayCtx = replay_context_t();
+    provisioningStats = liveProvisioning;
+    admissionStats = liveAdmission;
+    sessionStats = liveSessions;
+    pmkStats = livePmk;
+    bondStats = liveBonds;
+    portENTER_CRITICAL(&timelineMux);
+    std::copy(liveTimelines.begin(), liveTimelines.end(), timelines);
+    timelineCount = liveTimelineCount;
+    portEXIT_CRITICAL(&timelineMux);
+
+    ESP_LOGI(TAG, "Replayed %u events and %u callbacks (%u skipped) covering %lld us, %lld us in handlers, heap delta %d",
+        (unsigned)stats->events, (unsigned)stats->callbacks, (unsigned)stats->skipped, (long long)stats->virtualDurationUsecs,
+        (long long)stats->handlerUsecs, (int)stats->freeHeapDelta);
+    return ESP_OK;
+}
+
 void ImprovServer::onReset(int reason) 
 {
     ESP_LOGW(TAG, "Resetting state; reason=%d\n", reason);
@@ -168,9 +1046,14 @@ void ImprovServer::onSync()
     uint8_t addr_val[6] = {0};
     rc = ble_hs_id_copy_addr(addrType, addr_val, NULL);
     ESP_LOGI(TAG, "Device address (type %d): %02x:%02x:%02x:%02x:%02x:%02x", addrType, addr_val[5], addr_val[4], addr_val[3], addr_val[2], addr_val[1], addr_val[0]);
+#if CONFIG_IMPROV_GATT_CACHING
+    checkDatabaseChanged();
+#endif
     ESP_LOGI(TAG, "On sync completed, signaling advertise task to start.");
-    // Notify the task that advertising has started
-    xTaskNotifyGive(advertiseTaskHandle);
+    // Notify the task that advertising has started, unless it's already gone
+    if (advertiseTaskHandle != NULL && !shutdownRequested) {
+        xTaskNotifyGive(advertiseTaskHandle);
+    }
 }
 
 void ImprovServer::hostTask(void *param)
@@ -180,7 +1063,9 @@ void ImprovServer::hostTask(void *param)
     /* This function will return only when nimble_port_stop() is executed */
     nimble_port_run();
 
-    nimble_port_freertos_deinit();
+    ESP_LOGI(TAG, "BLE Host Task: stopped");
+    xSemaphoreGive(hostExitSem);
+    vTaskDelete(NULL);
 }
 
 esp_err_t ImprovServer::StopAdvertising() 
@@ -195,13 +1080,22 @@ esp_err_t ImprovServer::StartAdvertising()
     return ESP_OK;
 }
 
+// Sleeps for the given time, returns true if woken up early to shut down
+bool ImprovServer::advertiseWait(uint32_t msecs)
+{
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(msecs));
+    return shutdownRequested;
+}
+
 void ImprovServer::advertiseTask(void *param)
 {
+    ImprovServer *s = (ImprovServer *)param;
+    adv_slot_t slot = { ADV_PAYLOAD_SERVICE, ADVERTISE_NAME_EVERY_MSECS };
     int rc = 0;
 
     ESP_LOGI(TAG, "BLE Advertise Task: waiting to start...");
     ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
-    while (true) {
+    while (!shutdownRequested) {
         if (advertising && !advertiseOn) {
             ESP_LOGI(TAG, "Stopping advertising.");
             rc = ble_gap_adv_stop();
@@ -213,9 +1107,11 @@ void ImprovServer::advertiseTask(void *param)
         }
         if (state == improv::STATE_PROVISIONED) {
             ESP_LOGI(TAG, "Just provisioned, waiting and resetting state...");
-            vTaskDelay(pdMS_TO_TICKS(AFTER_PROVISION_DELAY));
+            if (advertiseWait(AFTER_PROVISION_DELAY)) {
+                break;
+            }
             
-            if (connHandle != 0) {
+            if (connHandle != BLE_HS_CONN_HANDLE_NONE) {
                 ESP_LOGI(TAG, "Disconnecting client, handle=%d", connHandle);
                 rc = ble_gap_terminate(connHandle, 0);
                 if (rc != 0) {
@@ -223,38 +1119,57 @@ void ImprovServer::advertiseTask(void *param)
                 }
             }
             state = improv::STATE_AUTHORIZED;
+            updateAdvertisingData();
+            if (autoShutdown) {
+                // Shutdown() waits for this task to exit, so it can't be called from here.
+                // The task is about to exit, so Shutdown() must not notify it.
+                ESP_LOGI(TAG, "Provisioned, shutting down BLE.");
+                advertiseTaskHandle = NULL;
+                xTaskCreate(ImprovServer::shutdownTask, "ble_shutdown_task", 4096, (void *)s, 1, NULL);
+                break;
+            }
         }
         if (advertiseOn && !advertising) {
             ESP_LOGI(TAG, "Starting advertising.");
+            scheduler.Reset();
+            slot = scheduler.Next();
+            advertiseName = slot.payload == ADV_PAYLOAD_NAME;
             advertise();
             advertising = true;
         } else if (advertiseOn && advertising) {
-            vTaskDelay(pdMS_TO_TICKS(ADVERTISE_NAME_EVERY_MSECS));
-            ESP_LOGD(TAG, "BLE Advertise Task: starting to advertise name.");
-            advertiseName = true;
+            if (advertiseWait(slot.durationMsecs)) {
+                break;
+            }
+            slot = scheduler.Next();
+            ESP_LOGD(TAG, "BLE Advertise Task: starting to advertise %s.",
+                slot.payload == ADV_PAYLOAD_NAME ? "name" : "service and service data");
             rc = ble_gap_adv_stop();
             if (rc != 0) {
                 ESP_LOGE(TAG, "BLE Advertise Task: failed to stop advertising!");
                 continue;
             }
-            advertise();
-            vTaskDelay(pdMS_TO_TICKS(ADVERTISE_NAME_FOR_MSECS));
-            ESP_LOGD(TAG, "BLE Advertise Task: starting to advertise service and service data.");
-            rc = ble_gap_adv_stop();
-            if (rc != 0) {
-                ESP_LOGE(TAG, "BLE Advertise Task: failed to stop advertising!");
-                continue;
-            }
-            advertiseName = false;
+            advertiseName = slot.payload == ADV_PAYLOAD_NAME;
             advertise();
             advertising = true;
             continue;
         }
-        vTaskDelay(pdMS_TO_TICKS(100));
+        advertiseWait(100);
     }
+
+    ESP_LOGI(TAG, "BLE Advertise Task: stopped");
+    xSemaphoreGive(advertiseExitSem);
+    vTaskDelete(NULL);
 }
 
-esp_err_t ImprovServer::Initialize(wifi_provision_fn onProvisionCallback, void *args)
+void ImprovServer::shutdownTask(void *param)
+{
+    ImprovServer *s = (ImprovServer *)param;
+
+    s->Shutdown(autoShutdownReleaseMemory);
+    vTaskDelete(NULL);
+}
+
+esp_err_t ImprovServer::startStack()
 {
     esp_err_t err;
 
@@ -267,28 +1182,230 @@ esp_err_t ImprovServer::Initialize(wifi_provision_fn onProvisionCallback, void *
     /* Initialize the NimBLE host configuration */
     ble_hs_cfg.sync_cb = ImprovServer::onSync;
     ble_hs_cfg.reset_cb = ImprovServer::onReset;
-
-    onProvision = onProvisionCallback;
-    onProvisionArgs = args;
+#if CONFIG_IMPROV_BONDING
+    /* LE Secure Connections "Just Works" bonding, keys kept in our own store */
+    ble_hs_cfg.sm_io_cap = BLE_SM_IO_CAP_NO_IO;
+    ble_hs_cfg.sm_bonding = 1;
+    ble_hs_cfg.sm_mitm = 0;
+    ble_hs_cfg.sm_sc = 1;
+    ble_hs_cfg.sm_our_key_dist = BLE_SM_PAIR_KEY_DIST_ENC | BLE_SM_PAIR_KEY_DIST_ID;
+    ble_hs_cfg.sm_their_key_dist = BLE_SM_PAIR_KEY_DIST_ENC | BLE_SM_PAIR_KEY_DIST_ID;
+    ble_hs_cfg.store_read_cb = ImprovServer::storeRead;
+    ble_hs_cfg.store_write_cb = ImprovServer::storeWrite;
+    ble_hs_cfg.store_delete_cb = ImprovServer::storeDelete;
+    ble_hs_cfg.store_status_cb = ImprovServer::storeStatus;
+    loadBonds();
+#endif
 
     err = initServer();
     if (err != ESP_OK) {
         ESP_LOGE(TAG, "Improv server initialization failed!");
+        nimble_port_deinit();
         return err;
     }
 
     int rc = ble_svc_gap_device_name_set(ImprovServer::deviceName->c_str());
     if (rc != 0) {
         ESP_LOGE(TAG, "ble_svc_gap_device_name_set failed!");
+        nimble_port_deinit();
         return ESP_FAIL;
     }
+
+    if (provisionLock == NULL) {
+        // One per task, so a late exit can't satisfy the wait for another task
+        advertiseExitSem = xSemaphoreCreateBinary();
+        provisionExitSem = xSemaphoreCreateBinary();
+        hostExitSem = xSemaphoreCreateBinary();
+        provisionLock = xSemaphoreCreateMutex();
+        deadlineTimer = xTimerCreate("improv_deadline", pdMS_TO_TICKS(PROVISIONING_DEADLINE_MSECS), pdFALSE, NULL, ImprovServer::deadlineTimerCallback);
+        if (advertiseExitSem == NULL || provisionExitSem == NULL || hostExitSem == NULL ||
+            provisionLock == NULL || deadlineTimer == NULL) {
+            nimble_port_deinit();
+            return ESP_ERR_NO_MEM;
+        }
+    }
+
+    shutdownRequested = false;
+    advertising = false;
+    acceptListDirty = admissionPolicy.acceptListLen > 0;
+    connHandle = BLE_HS_CONN_HANDLE_NONE;
+    state = improv::STATE_AUTHORIZED;
+    error = improv::ERROR_NONE;
     
     xTaskCreate(ImprovServer::advertiseTask, "ble_advertise_task", 4096, (void *)this, 1, &advertiseTaskHandle);
+    xTaskCreate(ImprovServer::provisionTask, "improv_provision_task", 4096, (void *)this, 1, &provisionTaskHandle);
     xTaskCreate(ImprovServer::hostTask, "ble_host_task", 4096, (void *)this, 1, NULL);
 
+    running = true;
     return ESP_OK;
 }
 
+esp_err_t ImprovServer::Initialize(wifi_provision_fn onProvisionCallback, void *args)
+{
+    if (running) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    onProvision = onProvisionCallback;
+    onProvisionArgs = args;
+
+    return startStack();
+}
+
+esp_err_t ImprovServer::Initialize(wifi_provision_cancellable_fn onProvisionCallback, void *args)
+{
+    if (running) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    onProvisionCancellable = onProvisionCallback;
+    onProvisionArgs = args;
+
+    return startStack();
+}
+
+esp_err_t ImprovServer::Shutdown(bool releaseControllerMemory)
+{
+    int rc;
+
+    if (!running) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    // Each task is told to stop once; after a failure (e.g. a non-cancellable callback
+    // still connecting) the server stays running and calling again resumes from here
+    if (shutdownPhase == SHUTDOWN_IDLE) {
+        shutdownStats.freeHeapBefore = esp_get_free_heap_size();
+        ESP_LOGI(TAG, "Shutting down BLE, free heap %u bytes", (unsigned)shutdownStats.freeHeapBefore);
+
+        shutdownRequested = true;
+        advertiseOn = false;
+        if (advertiseTaskHandle != NULL) {
+            xTaskNotifyGive(advertiseTaskHandle);
+        }
+        shutdownPhase = SHUTDOWN_ADVERTISE_TASK;
+    }
+
+    if (shutdownPhase == SHUTDOWN_ADVERTISE_TASK) {
+        if (xSemaphoreTake(advertiseExitSem, pdMS_TO_TICKS(SHUTDOWN_TASK_TIMEOUT_MSECS)) != pdTRUE) {
+            ESP_LOGE(TAG, "BLE Advertise Task did not stop!");
+            return ESP_ERR_TIMEOUT;
+        }
+        advertiseTaskHandle = NULL;
+
+        // Cancel any attempt in flight, cancellable callbacks return early
+        xSemaphoreTake(provisionLock, portMAX_DELAY);
+        activeAttempt++;
+        attemptFinished = true;
+        xSemaphoreGive(provisionLock);
+        xTimerStop(deadlineTimer, 0);
+        xTaskNotifyGive(provisionTaskHandle);
+        shutdownPhase = SHUTDOWN_PROVISION_TASK;
+    }
+
+    if (shutdownPhase == SHUTDOWN_PROVISION_TASK) {
+        if (xSemaphoreTake(provisionExitSem, pdMS_TO_TICKS(SHUTDOWN_TASK_TIMEOUT_MSECS)) != pdTRUE) {
+            ESP_LOGE(TAG, "Provisioning Task did not stop, call Shutdown() again once the callback returns!");
+            return ESP_ERR_TIMEOUT;
+        }
+        provisionTaskHandle = NULL;
+
+        if (advertising) {
+            rc = ble_gap_adv_stop();
+            if (rc != 0 && rc != BLE_HS_EALREADY) {
+                ESP_LOGW(TAG, "Failed to stop advertising, rc=%d", rc);
+            }
+            advertising = false;
+        }
+        if (connHandle != BLE_HS_CONN_HANDLE_NONE) {
+            ESP_LOGI(TAG, "Disconnecting client, handle=%d", connHandle);
+            rc = ble_gap_terminate(connHandle, BLE_ERR_REM_USER_CONN_TERM);
+            if (rc != 0) {
+                ESP_LOGW(TAG, "Failed to disconnect client, rc=%d", rc);
+            }
+            connHandle = BLE_HS_CONN_HANDLE_NONE;
+        }
+        shutdownPhase = SHUTDOWN_STOP_HOST;
+    }
+
+    if (shutdownPhase == SHUTDOWN_STOP_HOST) {
+        rc = nimble_port_stop();
+        if (rc != 0) {
+            ESP_LOGE(TAG, "nimble_port_stop failed, rc=%d", rc);
+            return ESP_FAIL;
+        }
+        shutdownPhase = SHUTDOWN_HOST_TASK;
+    }
+
+    if (shutdownPhase == SHUTDOWN_HOST_TASK) {
+        if (xSemaphoreTake(hostExitSem, pdMS_TO_TICKS(SHUTDOWN_TASK_TIMEOUT_MSECS)) != pdTRUE) {
+            ESP_LOGE(TAG, "BLE Host Task did not stop!");
+            return ESP_ERR_TIMEOUT;
+        }
+        shutdownPhase = SHUTDOWN_DEINIT;
+    }
+
+    esp_err_t err = nimble_port_deinit();
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "nimble_port_deinit failed, err=%d", err);
+        return err;
+    }
+    shutdownPhase = SHUTDOWN_IDLE;
+    running = false;
+
+    // Releasing the controller memory is permanent, BLE can't be restarted after this
+    shutdownStats.controllerMemoryReleased = false;
+#if CONFIG_BT_CONTROLLER_ENABLED
+    if (releaseControllerMemory) {
+        err = esp_bt_mem_release(ESP_BT_MODE_BTDM);
+        if (err != ESP_OK) {
+            ESP_LOGW(TAG, "esp_bt_mem_release failed, err=%d", err);
+        } else {
+            controllerMemoryReleased = true;
+            shutdownStats.controllerMemoryReleased = true;
+        }
+    }
+#endif
+
+    shutdownStats.freeHeapAfter = esp_get_free_heap_size();
+    ESP_LOGI(TAG, "BLE shut down, free heap %u bytes (reclaimed %d bytes)",
+        (unsigned)shutdownStats.freeHeapAfter, (int)(shutdownStats.freeHeapAfter - shutdownStats.freeHeapBefore));
+    return ESP_OK;
+}
+
+esp_err_t ImprovServer::Restart()
+{
+    if (shutdownPhase != SHUTDOWN_IDLE) {
+        ESP_LOGE(TAG, "Shutdown did not complete, call Shutdown() again first!");
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (running || (onProvision == NULL && onProvisionCancellable == NULL)) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (controllerMemoryReleased) {
+        ESP_LOGE(TAG, "Bluetooth controller memory was released, can't restart!");
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+
+    ESP_LOGI(TAG, "Restarting BLE, free heap %u bytes", (unsigned)esp_get_free_heap_size());
+    esp_err_t err = startStack();
+    if (err == ESP_OK) {
+        advertiseOn = true;
+    }
+    return err;
+}
+
+void ImprovServer::SetAutoShutdown(bool enable, bool releaseControllerMemory)
+{
+    autoShutdown = enable;
+    autoShutdownReleaseMemory = releaseControllerMemory;
+}
+
+shutdown_stats_t ImprovServer::GetShutdownStats()
+{
+    return shutdownStats;
+}
+
 ble_uuid128_t *ImprovServer::strToUuid(const char *_uuidStr) 
 {
     size_t i, si = 0;
@@ -319,6 +1436,7 @@ int ImprovServer::gattSvrChrDeviceInfo(uint16_t conn_handle, uint16_t attr_handl
     int rc;
 
     uuid = ble_uuid_u16(ctxt->chr->uuid);
+    traceGattAccess(uuid == GATT_MODEL_NUMBER_UUID ? TRACE_CHR_MODEL : TRACE_CHR_MANUFACTURER, conn_handle, attr_handle, ctxt);
     if (uuid == GATT_MODEL_NUMBER_UUID) {
         rc = os_mbuf_append(ctxt->om, ImprovServer::manufacturerName->c_str(), ImprovServer::manufacturerName->length());
         return rc == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
@@ -336,6 +1454,8 @@ int ImprovServer::gattSvrChrDeviceInfo(uint16_t conn_handle, uint16_t attr_handl
 int ImprovServer::gattSvrChrStatus(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg)
 {
     int rc;
+
+    traceGattAccess(TRACE_CHR_STATUS, conn_handle, attr_handle, ctxt);
     rc = os_mbuf_append(ctxt->om, &ImprovServer::state, sizeof(ImprovServer::state));
     return rc == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
 }
@@ -344,7 +1464,9 @@ int ImprovServer::gattSvrChrStatusNotify()
 {
     int rc = 0;
     struct os_mbuf *om;
-    if (connHandle != 0) {
+    updateAdvertisingData();
+    // No link behind a replayed session
+    if (connHandle != BLE_HS_CONN_HANDLE_NONE && !replaying) {
         om = ble_hs_mbuf_from_flat((uint8_t *)&state, sizeof(state));
         rc = ble_gatts_notify_custom(connHandle, statusHandle, om);
     }
@@ -355,16 +1477,29 @@ int ImprovServer::gattSvrChrErrorNotify()
 {
     int rc = 0;
     struct os_mbuf *om;
-    if (connHandle != 0) {
+    if (connHandle != BLE_HS_CONN_HANDLE_NONE && !replaying) {
         om = ble_hs_mbuf_from_flat((uint8_t *)&error, sizeof(error));
         rc = ble_gatts_notify_custom(connHandle, errorHandle, om);
     }
     return rc;
 }
 
+int ImprovServer::gattSvrChrRpcResultNotify()
+{
+    int rc = 0;
+    struct os_mbuf *om;
+    if (connHandle != BLE_HS_CONN_HANDLE_NONE && !rpcResult.empty() && !replaying) {
+        om = ble_hs_mbuf_from_flat(rpcResult.data(), rpcResult.size());
+        rc = ble_gatts_notify_custom(connHandle, rpcResultHandle, om);
+    }
+    return rc;
+}
+
 int ImprovServer::gattSvrChrError(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg)
 {
     int rc;
+
+    traceGattAccess(TRACE_CHR_ERROR, conn_handle, attr_handle, ctxt);
     rc = os_mbuf_append(ctxt->om, &error, sizeof(error));
     return rc == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
 }
@@ -378,28 +1513,59 @@ int ImprovServer::gattSvrChrRpcWrite(uint16_t conn_handle, uint16_t attr_handle,
     uint16_t copied_len;
     uint8_t *le_phy_val;
 
+    int64_t receivedAt = now();
+    traceGattAccess(TRACE_CHR_RPC_WRITE, conn_handle, attr_handle, ctxt);
+    clientActivity();
+    if (!rpcWritten && conn_handle == connHandle) {
+        rpcWritten = true;
+        sessionStats.writeSessions++;
+        sessionStats.lastConnectToWriteUsecs = now() - connectedAt;
+        sessionStats.totalConnectToWriteUsecs += sessionStats.lastConnectToWriteUsecs;
+    }
+
     len = OS_MBUF_PKTLEN(ctxt->om);
     if (len > 0) {
         le_phy_val = (uint8_t *)malloc(len * sizeof(uint8_t));
         if (le_phy_val) {
             rc = ble_hs_mbuf_to_flat(ctxt->om, le_phy_val, len, &copied_len);
-            if (rc == 0) {
+            if (rc == 0 && copied_len > 0 && le_phy_val[0] == IMPROV_CMD_CANCEL_PROVISIONING) {
+                // No payload, so the checksum equals the command byte
+                bool valid = copied_len == 3 && le_phy_val[1] == 0 && le_phy_val[2] == IMPROV_CMD_CANCEL_PROVISIONING;
+                free(le_phy_val);
+                if (!valid) {
+                    ESP_LOGE(TAG, "Invalid cancel command!");
+                    error = improv::ERROR_INVALID_RPC;
+                    gattSvrChrErrorNotify();
+                    return 0;
+                }
+                ESP_LOGI(TAG, "Client cancelled provisioning.");
+                s->CancelProvisioning();
+                return 0;
+            } else if (rc == 0 && copied_len > 0 && le_phy_val[0] == IMPROV_CMD_WIFI_SETTINGS_MULTI) {
+                provision_request_t *req = new provision_request_t();
+                bool valid = parseCredentialList(le_phy_val, copied_len, req->creds);
+                free(le_phy_val);
+                if (!valid) {
+                    delete req;
+                    ESP_LOGE(TAG, "Invalid multi-credential command!");
+                    error = improv::ERROR_INVALID_RPC;
+                    gattSvrChrErrorNotify();
+                    return 0;
+                }
+                req->multi = true;
+                req->receivedUsecs = receivedAt;
+                s->submitRequest(req);
+                return 0;
+            } else if (rc == 0) {
                 improv::ImprovCommand cmd = improv::parse_improv_data(le_phy_val, copied_len, true);
                 free(le_phy_val);
                 ESP_LOGI(TAG, "Provisioning wifi: %s, %s", cmd.ssid.c_str(), cmd.password.c_str());
 
-                state = improv::STATE_PROVISIONING;
-                gattSvrChrStatusNotify();
-
-                esp_err_t err = s->onWifiProvisioning(cmd.ssid.c_str(), cmd.password.c_str(), s->onProvisionArgs);
-                if (err != ESP_OK) {
-                    ESP_LOGE(TAG, "Failed to provision WiFi, rc=%d", err);
-                    error = improv::ERROR_UNABLE_TO_CONNECT;
-                    gattSvrChrErrorNotify();
-                } else {
-                    state = improv::STATE_PROVISIONED;
-                    gattSvrChrStatusNotify();
-                }
+                provision_request_t *req = new provision_request_t();
+                req->multi = false;
+                req->receivedUsecs = receivedAt;
+                req->creds.push_back(wifi_credential_t { cmd.ssid, cmd.password, 0, 0, WIFI_RSSI_NOT_FOUND });
+                s->submitRequest(req);
                 return 0;
             } else {
                 error = improv::ERROR_INVALID_RPC;
@@ -417,7 +1583,11 @@ int ImprovServer::gattSvrChrRpcResult(uint16_t conn_handle, uint16_t attr_handle
 {
     int rc;
 
-    ESP_LOGW(TAG, "RPC read result not supported!");
+    traceGattAccess(TRACE_CHR_RPC_RESULT, conn_handle, attr_handle, ctxt);
+    if (!rpcResult.empty()) {
+        rc = os_mbuf_append(ctxt->om, rpcResult.data(), rpcResult.size());
+        return rc == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
+    }
 
     uint8_t zero = 0;
     rc = os_mbuf_append(ctxt->om, &zero, sizeof(uint8_t));
@@ -430,20 +1600,1103 @@ int ImprovServer::gattSvrChrRpcResult(uint16_t conn_handle, uint16_t attr_handle
 int ImprovServer::gattSvrChrCapabilities(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg)
 {
     int rc;
+
+    traceGattAccess(TRACE_CHR_CAPABILITIES, conn_handle, attr_handle, ctxt);
     rc = os_mbuf_append(ctxt->om, &capabilities, sizeof(uint8_t));
     return rc == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
 }
 
-esp_err_t ImprovServer::onWifiProvisioning(const char *ssid, const char *password, void *args) 
+esp_err_t ImprovServer::onWifiProvisioning(const char *ssid, const char *password, const provision_token_t *token, void *args) 
 {
+    if (onProvisionCancellable != NULL) {
+        return onProvisionCancellable(ssid, password, token, args);
+    }
     esp_err_t err = onProvision(ssid, password, args);
     return err;
 }
 
+bool ImprovServer::parseCredentialList(const uint8_t *data, size_t len, std::vector<wifi_credential_t> &creds)
+{
+    uint8_t checksum = 0;
+
+    // command, length, count ... checksum
+    if (len < 4 || data[1] != len - 3) {
+        return false;
+    }
+    for (size_t i = 0; i < len - 1; i++) {
+        checksum += data[i];
+    }
+    if (checksum != data[len - 1]) {
+        return false;
+    }
+
+    size_t count = data[2];
+    size_t pos = 3;
+    if (count == 0 || count > MULTI_CREDENTIAL_MAX) {
+        return false;
+    }
+    for (size_t i = 0; i < count; i++) {
+        wifi_credential_t cred;
+        if (pos + 2 > len - 1) {
+            return false;
+        }
+        cred.priority = data[pos++];
+        size_t ssidLen = data[pos++];
+        if (ssidLen == 0 || pos + ssidLen + 1 > len - 1) {
+            return false;
+        }
+        cred.ssid.assign((const char *)data + pos, ssidLen);
+        pos += ssidLen;
+        size_t passwordLen = data[pos++];
+        if (pos + passwordLen > len - 1) {
+            return false;
+        }
+        cred.password.assign((const char *)data + pos, passwordLen);
+        pos += passwordLen;
+        cred.index = i;
+        cred.rssi = WIFI_RSSI_NOT_FOUND;
+        creds.push_back(cred);
+    }
+    return pos == len - 1;
+}
+
+// Replaces any queued request and cancels the one in flight, newest command wins
+void ImprovServer::submitRequest(provision_request_t *req)
+{
+    xSemaphoreTake(provisionLock, portMAX_DELAY);
+    if (shutdownRequested) {
+        // The provisioning task may already be gone
+        xSemaphoreGive(provisionLock);
+        delete req;
+        return;
+    }
+    if (pendingRequest != NULL || !attemptFinished) {
+        ESP_LOGI(TAG, "Superseding provisioning attempt %u", (unsigned)activeAttempt);
+        provisioningStats.superseded++;
+    }
+    delete pendingRequest;
+    req->attempt = ++activeAttempt;
+    req->deadlineUsecs = now() + (int64_t)provisioningDeadlineMsecs * 1000;
+    attemptFinished = false;
+    pendingRequest = req;
+    if (replaying) {
+        // The capture has no results for a request it didn't submit
+        replayCtx.attempt = 0;
+        for (const auto &submit : replayCtx.submits) {
+            if (submit.first == replayCtx.record) {
+                replayCtx.attempt = submit.second;
+            }
+        }
+    } else {
+        uint8_t payload[4];
+        memcpy(payload, &req->attempt, sizeof(payload));
+        traceRecord(TRACE_PROVISION_SUBMIT, connHandle, 0, payload, sizeof(payload));
+    }
+#if CONFIG_IMPROV_PMK_CACHE
+    // PBKDF2 takes hundreds of milliseconds, keep it off the attempt and derive
+    // in the background; the attempt only looks the PMK up in the cache
+    pmkJobs = req->creds;
+    if (pmkTaskHandle == NULL && !replaying) {
+        xTaskCreate(ImprovServer::pmkTask, "improv_pmk_task", 4096, NULL, tskIDLE_PRIORITY, &pmkTaskHandle);
+    }
+#endif
+    if (!replaying) {
+        // The previous callback may still be stuck in the task, so the deadline
+        // can't wait for this request to start running
+        deadlineAttempt = req->attempt;
+        xTimerChangePeriod(deadlineTimer, pdMS_TO_TICKS(provisioningDeadlineMsecs), 0);
+    }
+    xSemaphoreGive(provisionLock);
+    openTimeline(req);
+
+    if (replaying) {
+        // Replays run synchronously so the outcome is known when the event returns
+        pendingRequest = NULL;
+        runAttempt(req);
+        delete req;
+        return;
+    }
+    xTaskNotifyGive(provisionTaskHandle);
+}
+
+void ImprovServer::provisionTask(void *param)
+{
+    ImprovServer *s = (ImprovServer *)param;
+
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        if (shutdownRequested) {
+            break;
+        }
+        xSemaphoreTake(provisionLock, portMAX_DELAY);
+        provision_request_t *req = pendingRequest;
+        pendingRequest = NULL;
+        xSemaphoreGive(provisionLock);
+        if (req != NULL) {
+            s->runAttempt(req);
+            delete req;
+        }
+    }
+
+    xSemaphoreTake(provisionLock, portMAX_DELAY);
+    delete pendingRequest;
+    pendingRequest = NULL;
+    xSemaphoreGive(provisionLock);
+
+    ESP_LOGI(TAG, "Provisioning Task: stopped");
+    xSemaphoreGive(provisionExitSem);
+    vTaskDelete(NULL);
+}
+
+void ImprovServer::runAttempt(provision_request_t *req)
+{
+    provision_token_t token = { req->attempt, req->deadlineUsecs, NULL };
+    std::vector<wifi_credential_t> &creds = req->creds;
+
+    if (IsCancelled(&token)) {
+        return;
+    }
+    provisioningStats.attempts++;
+    state = improv::STATE_PROVISIONING;
+    error = improv::ERROR_NONE;
+    gattSvrChrStatusNotify();
+
+    if (req->multi && (onScan != NULL || replaying)) {
+        std::vector<const char *> ssids;
+        std::vector<int8_t> rssi(creds.size(), WIFI_RSSI_NOT_FOUND);
+        for (auto &cred : creds) {
+            ssids.push_back(cred.ssid.c_str());
+        }
+        esp_err_t err = ESP_OK;
+        bool scanned = true;
+        if (replaying) {
+            // Not scanned if no scan callback was set when the capture was taken
+            scanned = replayScan(rssi.data(), rssi.size(), &err);
+        } else {
+            err = onScan(ssids.data(), ssids.size(), rssi.data(), onScanArgs);
+            std::vector<uint8_t> payload(8 + rssi.size());
+            memcpy(payload.data(), &token.attempt, 4);
+            memcpy(payload.data() + 4, &err, 4);
+            memcpy(payload.data() + 8, rssi.data(), rssi.size());
+            traceRecord(TRACE_PROVISION_SCAN, 0, 0, payload.data(), payload.size());
+        }
+        if (scanned && err == ESP_OK) {
+            for (size_t i = 0; i < creds.size(); i++) {
+                creds[i].rssi = rssi[i];
+            }
+            creds.erase(std::remove_if(creds.begin(), creds.end(), [](const wifi_credential_t &c) {
+                return c.rssi == WIFI_RSSI_NOT_FOUND;
+            }), creds.end());
+        } else if (scanned) {
+            ESP_LOGW(TAG, "WiFi scan failed, trying all networks, err=%d", err);
+        }
+    }
+
+    // Strongest network in range first, then the rest in priority order
+    std::stable_sort(creds.begin(), creds.end(), [](const wifi_credential_t &a, const wifi_credential_t &b) {
+        return a.priority < b.priority;
+    });
+    auto strongest = std::max_element(creds.begin(), creds.end(), [](const wifi_credential_t &a, const wifi_credential_t &b) {
+        return a.rssi < b.rssi;
+    });
+    if (strongest != creds.end() && strongest->rssi != WIFI_RSSI_NOT_FOUND) {
+        std::rotate(creds.begin(), strongest, strongest + 1);
+    }
+
+    esp_err_t err = ESP_ERR_NOT_FOUND;
+    for (auto &cred : creds) {
+        if (IsCancelled(&token)) {
+            break;
+        }
+        if (req->multi) {
+            ESP_LOGI(TAG, "Provisioning wifi %d/%d: %s (priority %d, rssi %d)", cred.index + 1, (int)creds.size(),
+                cred.ssid.c_str(), cred.priority, cred.rssi);
+        }
+#if CONFIG_IMPROV_PMK_CACHE
+        // Not derived yet on the first connect to a network, the station derives it then
+        uint8_t pmk[WIFI_PMK_LEN];
+        esp_err_t pmkErr = lookupPmk(cred.ssid.c_str(), cred.password.c_str(), pmk);
+        token.pmk = pmkErr == ESP_OK ? pmk : NULL;
+        if (pmkErr == ESP_OK) {
+            pmkStats.hits++;
+        } else if (pmkErr == ESP_ERR_NOT_FOUND) {
+            // Open networks and raw PSKs are never cached, they don't count against the cache
+            pmkStats.misses++;
+        }
+#endif
+        startTimelineCandidate(token.attempt, &cred);
+        if (replaying) {
+            if (!replayProvisioning(&token, &cred, &err)) {
+                // Left in flight, as it was when the capture ended
+                return;
+            }
+        } else {
+            err = onWifiProvisioning(cred.ssid.c_str(), cred.password.c_str(), &token, onProvisionArgs);
+            uint8_t payload[9];
+            memcpy(payload, &token.attempt, 4);
+            payload[4] = cred.index;
+            memcpy(payload + 5, &err, 4);
+            traceRecord(TRACE_PROVISION_RESULT, 0, 0, payload, sizeof(payload));
+        }
+        stampTimeline(token.attempt, TIMELINE_CALLBACK_RETURNED, ESP_OK);
+        if (err == ESP_OK) {
+            finishAttempt(token.attempt, ESP_OK, &cred, req->multi);
+            return;
+        }
+        ESP_LOGW(TAG, "Failed to provision WiFi %s, rc=%d", cred.ssid.c_str(), err);
+    }
+    finishAttempt(token.attempt, now() >= token.deadlineUsecs ? ESP_ERR_TIMEOUT : err, NULL, req->multi);
+}
+
+// Reports the outcome of an attempt once, unless it has been superseded or cancelled
+bool ImprovServer::finishAttempt(uint32_t attempt, esp_err_t err, const wifi_credential_t *cred, bool multi)
+{
+    xSemaphoreTake(provisionLock, portMAX_DELAY);
+    if (attempt != activeAttempt || attemptFinished) {
+        xSemaphoreGive(provisionLock);
+        return false;
+    }
+    attemptFinished = true;
+    xSemaphoreGive(provisionLock);
+    if (!replaying) {
+        xTimerStop(deadlineTimer, 0);
+    }
+    stampTimeline(attempt, TIMELINE_FINISHED, err);
+
+    if (err == ESP_OK) {
+        provisioningStats.succeeded++;
+        if (multi) {
+            rpcResult = improv::build_rpc_response((improv::Command)IMPROV_CMD_WIFI_SETTINGS_MULTI,
+                std::vector<std::string> { cred->ssid, std::to_string(cred->index) }, true);
+            gattSvrChrRpcResultNotify();
+        }
+        state = improv::STATE_PROVISIONED;
+        gattSvrChrStatusNotify();
+        return true;
+    }
+
+    if (err == ESP_ERR_TIMEOUT) {
+        ESP_LOGE(TAG, "Provisioning attempt %u timed out", (unsigned)attempt);
+        provisioningStats.timedOut++;
+    } else {
+        ESP_LOGE(TAG, "Failed to provision WiFi, rc=%d", err);
+        provisioningStats.failed++;
+    }
+    error = improv::ERROR_UNABLE_TO_CONNECT;
+    gattSvrChrErrorNotify();
+    state = improv::STATE_AUTHORIZED;
+    gattSvrChrStatusNotify();
+    return true;
+}
+
+void ImprovServer::deadlineTimerCallback(TimerHandle_t timer)
+{
+    finishAttempt(deadlineAttempt, ESP_ERR_TIMEOUT, NULL, false);
+}
+
+void ImprovServer::openTimeline(const provision_request_t *req)
+{
+    portENTER_CRITICAL(&timelineMux);
+    provision_timeline_t *t = &timelines[timelineCount % TIMELINE_RING_SIZE];
+    memset(t, 0, sizeof(provision_timeline_t));
+    t->attempt = req->attempt;
+    t->result = ESP_FAIL;
+    if (!req->creds.empty()) {
+        strncpy(t->ssid, req->creds[0].ssid.c_str(), sizeof(t->ssid) - 1);
+    }
+    t->stamps[TIMELINE_BLE_RECEIVED] = req->receivedUsecs;
+    t->stamps[TIMELINE_COMMAND_DECODED] = now();
+    timelineCount++;
+    portEXIT_CRITICAL(&timelineMux);
+}
+
+// Stamps the first occurrence of a phase in the attempt's timeline. WiFi phases
+// may come after the outcome was reported, e.g. DHCP after the callback returned.
+void ImprovServer::stampTimeline(uint32_t attempt, timeline_phase_t phase, esp_err_t result)
+{
+    int64_t stamp = now();
+
+    portENTER_CRITICAL(&timelineMux);
+    if (timelineCount > 0) {
+        provision_timeline_t *t = &timelines[(timelineCount - 1) % TIMELINE_RING_SIZE];
+        if (t->attempt == attempt && t->stamps[phase] == 0) {
+            t->stamps[phase] = stamp;
+            if (phase == TIMELINE_FINISHED) {
+                t->finished = true;
+                t->result = result;
+            }
+        }
+    }
+    portEXIT_CRITICAL(&timelineMux);
+}
+
+// Starts the callback phases over for the next network of a multi-credential attempt
+void ImprovServer::startTimelineCandidate(uint32_t attempt, const wifi_credential_t *cred)
+{
+    int64_t stamp = now();
+
+    portENTER_CRITICAL(&timelineMux);
+    if (timelineCount > 0) {
+        provision_timeline_t *t = &timelines[(timelineCount - 1) % TIMELINE_RING_SIZE];
+        if (t->attempt == attempt) {
+            for (int p = TIMELINE_CALLBACK_ENTERED; p <= TIMELINE_CALLBACK_RETURNED; p++) {
+                t->stamps[p] = 0;
+            }
+            t->stamps[TIMELINE_CALLBACK_ENTERED] = stamp;
+            memset(t->bssid, 0, sizeof(t->bssid));
+            memset(t->ssid, 0, sizeof(t->ssid));
+            strncpy(t->ssid, cred->ssid.c_str(), sizeof(t->ssid) - 1);
+            t->candidates++;
+        }
+    }
+    portEXIT_CRITICAL(&timelineMux);
+}
+
+void ImprovServer::StampTimeline(timeline_phase_t phase)
+{
+    if (phase < TIMELINE_PHASE_MAX) {
+        stampTimeline(activeAttempt, phase, ESP_OK);
+    }
+}
+
+size_t ImprovServer::GetTimelines(provision_timeline_t *out, size_t max)
+{
+    size_t n = 0;
+
+    portENTER_CRITICAL(&timelineMux);
+    size_t first = timelineCount > TIMELINE_RING_SIZE ? timelineCount - TIMELINE_RING_SIZE : 0;
+    for (size_t i = first; i < timelineCount && n < max; i++) {
+        out[n++] = timelines[i % TIMELINE_RING_SIZE];
+    }
+    portEXIT_CRITICAL(&timelineMux);
+    return n;
+}
+
+void ImprovServer::LogTimelines()
+{
+    static const char *phaseNames[TIMELINE_PHASE_MAX] = {
+        "decoded", "callback", "associated", "handshake", "dhcp", "first_ip", "returned", "finished",
+    };
+    provision_timeline_t t[TIMELINE_RING_SIZE];
+    size_t n = GetTimelines(t, TIMELINE_RING_SIZE);
+
+    for (size_t i = 0; i < n; i++) {
+        char line[256];
+        int len = 0;
+        for (int p = TIMELINE_COMMAND_DECODED; p < TIMELINE_PHASE_MAX && len < (int)sizeof(line); p++) {
+            if (t[i].stamps[p] != 0) {
+                len += snprintf(line + len, sizeof(line) - len, " %s=+%lldms", phaseNames[p - 1],
+                    (long long)(t[i].stamps[p] - t[i].stamps[TIMELINE_BLE_RECEIVED]) / 1000);
+            }
+        }
+        ESP_LOGI(TAG, "attempt %u ssid=%s (%u tried) bssid=%02x:%02x:%02x:%02x:%02x:%02x result=%d:%s", (unsigned)t[i].attempt,
+            t[i].ssid, (unsigned)t[i].candidates, t[i].bssid[0], t[i].bssid[1], t[i].bssid[2], t[i].bssid[3], t[i].bssid[4], t[i].bssid[5],
+            t[i].finished ? t[i].result : -1, len > 0 ? line : "");
+    }
+}
+
+void ImprovServer::wifiEventHandler(void *arg, esp_event_base_t base, int32_t id, void *data)
+{
+    if (base == WIFI_EVENT && id == WIFI_EVENT_STA_CONNECTED) {
+        // Posted once the 4-way handshake is done, when the DHCP client starts
+        wifi_event_sta_connected_t *event = (wifi_event_sta_connected_t *)data;
+        StampTimeline(TIMELINE_WIFI_HANDSHAKE_DONE);
+        portENTER_CRITICAL(&timelineMux);
+        if (timelineCount > 0) {
+            provision_timeline_t *t = &timelines[(timelineCount - 1) % TIMELINE_RING_SIZE];
+            if (t->attempt == activeAttempt && t->bssid[0] == 0 && t->bssid[1] == 0 && t->bssid[2] == 0) {
+                memcpy(t->bssid, event->bssid, sizeof(t->bssid));
+            }
+        }
+        portEXIT_CRITICAL(&timelineMux);
+    } else if (base == IP_EVENT && id == IP_EVENT_STA_GOT_IP) {
+        StampTimeline(TIMELINE_DHCP_LEASE);
+    }
+}
+
+esp_err_t ImprovServer::EnableWifiEventTimeline()
+{
+    esp_err_t err;
+
+    err = esp_event_handler_register(WIFI_EVENT, WIFI_EVENT_STA_CONNECTED, ImprovServer::wifiEventHandler, NULL);
+    if (err != ESP_OK) {
+        return err;
+    }
+    return esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP, ImprovServer::wifiEventHandler, NULL);
+}
+
+bool ImprovServer::IsCancelled(const provision_token_t *token)
+{
+    return token->attempt != activeAttempt || now() >= token->deadlineUsecs;
+}
+
+esp_err_t ImprovServer::CancelProvisioning()
+{
+    if (provisionLock == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    xSemaphoreTake(provisionLock, portMAX_DELAY);
+    bool inFlight = pendingRequest != NULL || !attemptFinished;
+    delete pendingRequest;
+    pendingRequest = NULL;
+    activeAttempt++;
+    attemptFinished = true;
+    xSemaphoreGive(provisionLock);
+    if (!inFlight) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (!replaying) {
+        xTimerStop(deadlineTimer, 0);
+    }
+
+    provisioningStats.cancelled++;
+    state = improv::STATE_AUTHORIZED;
+    gattSvrChrStatusNotify();
+    return ESP_OK;
+}
+
+void ImprovServer::SetScanCallback(wifi_scan_fn onScanCallback, void *args)
+{
+    onScan = onScanCallback;
+    onScanArgs = args;
+}
+
+void ImprovServer::SetProvisioningDeadline(uint32_t msecs)
+{
+    provisioningDeadlineMsecs = msecs;
+}
+
+adv_update_stats_t ImprovServer::GetAdvertisingUpdateStats()
+{
+    adv_update_stats_t stats = advUpdateStats;
+
+    // Scanners see the new data at the next advertising event after the update,
+    // or after the name advertisement if the change was deferred
+    int64_t worst = stats.maxLatencyUsecs;
+    if (stats.deferred > 0 && worst < ADVERTISE_NAME_FOR_MSECS * 1000) {
+        worst = ADVERTISE_NAME_FOR_MSECS * 1000;
+    }
+    stats.airBoundUsecs = worst +
+        (connHandle != BLE_HS_CONN_HANDLE_NONE ? BLE_GAP_ADV_FAST_INTERVAL2_MAX : BLE_GAP_ADV_FAST_INTERVAL1_MAX) * 625;
+    return stats;
+}
+
+provisioning_stats_t ImprovServer::GetProvisioningStats()
+{
+    return provisioningStats;
+}
+
+int ImprovServer::gattSvrChrGattService(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg)
+{
+    int rc;
+    uint16_t uuid = ble_uuid_u16(ctxt->chr->uuid);
+
+    traceGattAccess(uuid == GATT_SERVICE_CHANGED_UUID ? TRACE_CHR_SVC_CHANGED : TRACE_CHR_DB_HASH,
+        conn_handle, attr_handle, ctxt);
+    switch (uuid) {
+    case GATT_SERVICE_CHANGED_UUID: {
+        // Whole database
+        uint8_t range[4] = { 0x01, 0x00, 0xff, 0xff };
+        rc = os_mbuf_append(ctxt->om, range, sizeof(range));
+        return rc == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
+    }
+    case GATT_DATABASE_HASH_UUID:
+        rc = os_mbuf_append(ctxt->om, dbHash, sizeof(dbHash));
+        return rc == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
+    }
+    return BLE_ATT_ERR_UNLIKELY;
+}
+
+#if CONFIG_IMPROV_GATT_CACHING
+static void appendUuid(std::vector<uint8_t> &buf, const ble_uuid_t *uuid)
+{
+    if (uuid->type == BLE_UUID_TYPE_16) {
+        uint16_t v = ble_uuid_u16(uuid);
+        buf.push_back(v & 0xff);
+        buf.push_back(v >> 8);
+    } else {
+        const ble_uuid128_t *u = (const ble_uuid128_t *)uuid;
+        buf.insert(buf.end(), u->value, u->value + sizeof(u->value));
+    }
+}
+
+static void appendHandle(std::vector<uint8_t> &buf, uint16_t handle, uint16_t type)
+{
+    buf.push_back(handle & 0xff);
+    buf.push_back(handle >> 8);
+    buf.push_back(type & 0xff);
+    buf.push_back(type >> 8);
+}
+
+// AES-CMAC with a zero key over the service, characteristic and descriptor
+// declarations the server registers, as in the Database Hash definition. The
+// GAP service is owned by NimBLE, so the IDF version stands in for it.
+esp_err_t ImprovServer::computeDatabaseHash()
+{
+    std::vector<uint8_t> input;
+    uint16_t svcHandle, defHandle, valHandle;
+    int rc;
+
+    for (const struct ble_gatt_svc_def *s = svcs; s->type != 0; s++) {
+        rc = ble_gatts_find_svc(s->uuid, &svcHandle);
+        if (rc != 0) {
+            return ESP_ERR_NOT_FOUND;
+        }
+        appendHandle(input, svcHandle, 0x2800);
+        appendUuid(input, s->uuid);
+        for (const struct ble_gatt_chr_def *c = s->characteristics; c->uuid != NULL; c++) {
+            rc = ble_gatts_find_chr(s->uuid, c->uuid, &defHandle, &valHandle);
+            if (rc != 0) {
+                return ESP_ERR_NOT_FOUND;
+            }
+            appendHandle(input, defHandle, 0x2803);
+            input.push_back(c->flags & 0xff);
+            input.push_back(valHandle & 0xff);
+            input.push_back(valHandle >> 8);
+            appendUuid(input, c->uuid);
+            if (c->flags & (BLE_GATT_CHR_F_NOTIFY | BLE_GATT_CHR_F_INDICATE)) {
+                // NimBLE adds the CCCD right after the value
+                appendHandle(input, valHandle + 1, 0x2902);
+            }
+        }
+    }
+    const char *idfVersion = esp_get_idf_version();
+    input.insert(input.end(), idfVersion, idfVersion + strlen(idfVersion));
+
+    const uint8_t key[16] = {};
+    rc = mbedtls_cipher_cmac(mbedtls_cipher_info_from_type(MBEDTLS_CIPHER_AES_128_ECB), key, 128,
+        input.data(), input.size(), dbHash);
+    return rc == 0 ? ESP_OK : ESP_FAIL;
+}
+
+// Notes whether the table differs from the one clients saw before. No client is
+// connected yet at sync and CCCDs aren't persisted, so Service Changed is indicated
+// when a client subscribes to it, and the new hash is stored once one confirms it.
+void ImprovServer::checkDatabaseChanged()
+{
+    uint8_t stored[GATT_DATABASE_HASH_LEN] = {};
+    size_t len = sizeof(stored);
+    nvs_handle_t nvs;
+
+    if (computeDatabaseHash() != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to compute GATT database hash!");
+        return;
+    }
+    if (nvs_open(GATT_DATABASE_HASH_NVS_NAMESPACE, NVS_READONLY, &nvs) == ESP_OK) {
+        esp_err_t err = nvs_get_blob(nvs, GATT_DATABASE_HASH_NVS_KEY, stored, &len);
+        nvs_close(nvs);
+        if (err == ESP_OK && len == sizeof(stored) && memcmp(stored, dbHash, sizeof(dbHash)) == 0) {
+            databaseChanged = false;
+            return;
+        }
+    }
+    ESP_LOGI(TAG, "GATT database changed, Service Changed will be indicated to the next client");
+    databaseChanged = true;
+}
+
+void ImprovServer::serviceChangedSubscribed(uint16_t conn_handle)
+{
+    if (!databaseChanged || replaying) {
+        return;
+    }
+    int rc = ble_gatts_indicate(conn_handle, svcChangedHandle);
+    if (rc != 0) {
+        ESP_LOGW(TAG, "Failed to indicate Service Changed, rc=%d", rc);
+    }
+}
+
+void ImprovServer::serviceChangedConfirmed()
+{
+    nvs_handle_t nvs;
+
+    // A replayed confirmation doesn't mean a real client has seen the indication
+    if (replaying) {
+        return;
+    }
+    ESP_LOGI(TAG, "Service Changed confirmed, storing GATT database hash");
+    databaseChanged = false;
+    if (nvs_open(GATT_DATABASE_HASH_NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to open NVS, can't track GATT database changes");
+        return;
+    }
+    nvs_set_blob(nvs, GATT_DATABASE_HASH_NVS_KEY, dbHash, sizeof(dbHash));
+    nvs_commit(nvs);
+    nvs_close(nvs);
+}
+#endif
+
+/*
+ * PMK cache entries are keyed by the SSID and hold a SHA-256 of the SSID and
+ * passphrase to notice passphrase changes. An index blob lists the keys, most
+ * recently derived first, and the oldest entry is dropped when it is full.
+ */
+esp_err_t ImprovServer::pmkCacheKey(const char *ssid, const char *password, uint8_t *id, uint8_t *digest)
+{
+    size_t ssidLen = strlen(ssid);
+    size_t passwordLen = strlen(password);
+
+    // Open networks have no PMK, a 64 character passphrase already is one
+    if (ssidLen == 0 || ssidLen > 32 || passwordLen < 8 || passwordLen > 63) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    mbedtls_sha256_context sha;
+    mbedtls_sha256_init(&sha);
+    mbedtls_sha256_starts(&sha, 0);
+    mbedtls_sha256_update(&sha, (const unsigned char *)ssid, ssidLen + 1);
+    mbedtls_sha256_update(&sha, (const unsigned char *)password, passwordLen);
+    mbedtls_sha256_finish(&sha, digest);
+    mbedtls_sha256_free(&sha);
+
+    uint8_t ssidDigest[32];
+    mbedtls_sha256((const unsigned char *)ssid, ssidLen, ssidDigest, 0);
+    memcpy(id, ssidDigest, PMK_CACHE_ID_LEN);
+    return ESP_OK;
+}
+
+// NVS keys are at most 15 characters
+void ImprovServer::pmkCacheKeyName(const uint8_t *id, char *key)
+{
+    for (int i = 0; i < PMK_CACHE_ID_LEN; i++) {
+        sprintf(key + i * 2, "%02x", id[i]);
+    }
+}
+
+// Cache lookup only, never derives
+esp_err_t ImprovServer::lookupPmk(const char *ssid, const char *password, uint8_t *pmk)
+{
+    uint8_t id[PMK_CACHE_ID_LEN];
+    uint8_t digest[32];
+    uint8_t entry[sizeof(digest) + WIFI_PMK_LEN];
+    char key[16];
+    nvs_handle_t nvs;
+
+    esp_err_t err = pmkCacheKey(ssid, password, id, digest);
+    if (err != ESP_OK) {
+        return err;
+    }
+    pmkCacheKeyName(id, key);
+    err = nvs_open(PMK_CACHE_NVS_NAMESPACE, NVS_READONLY, &nvs);
+    if (err != ESP_OK) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    size_t len = sizeof(entry);
+    err = nvs_get_blob(nvs, key, entry, &len);
+    nvs_close(nvs);
+    if (err != ESP_OK || len != sizeof(entry) || memcmp(entry, digest, sizeof(digest)) != 0) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    memcpy(pmk, entry + sizeof(digest), WIFI_PMK_LEN);
+    return ESP_OK;
+}
+
+void ImprovServer::storePmk(const uint8_t *id, const uint8_t *digest, const uint8_t *pmk)
+{
+    uint8_t entry[32 + WIFI_PMK_LEN];
+    uint8_t index[PMK_CACHE_MAX_ENTRIES * PMK_CACHE_ID_LEN];
+    uint8_t newIndex[PMK_CACHE_MAX_ENTRIES * PMK_CACHE_ID_LEN];
+    char key[16];
+    nvs_handle_t nvs;
+
+    if (nvs_open(PMK_CACHE_NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to open NVS, PMK not cached");
+        return;
+    }
+    size_t len = sizeof(index);
+    if (nvs_get_blob(nvs, PMK_CACHE_INDEX_KEY, index, &len) != ESP_OK) {
+        len = 0;
+    }
+
+    // This network first, then the others until the cache is full
+    memcpy(newIndex, id, PMK_CACHE_ID_LEN);
+    size_t newLen = PMK_CACHE_ID_LEN;
+    for (size_t pos = 0; pos + PMK_CACHE_ID_LEN <= len; pos += PMK_CACHE_ID_LEN) {
+        if (memcmp(index + pos, id, PMK_CACHE_ID_LEN) == 0) {
+            continue;
+        }
+        if (newLen < sizeof(newIndex)) {
+            memcpy(newIndex + newLen, index + pos, PMK_CACHE_ID_LEN);
+            newLen += PMK_CACHE_ID_LEN;
+        } else {
+            pmkCacheKeyName(index + pos, key);
+            nvs_erase_key(nvs, key);
+            pmkStats.evictions++;
+        }
+    }
+
+    pmkCacheKeyName(id, key);
+    memcpy(entry, digest, 32);
+    memcpy(entry + 32, pmk, WIFI_PMK_LEN);
+    if (nvs_set_blob(nvs, key, entry, sizeof(entry)) != ESP_OK ||
+        nvs_set_blob(nvs, PMK_CACHE_INDEX_KEY, newIndex, newLen) != ESP_OK ||
+        nvs_commit(nvs) != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to cache PMK");
+    }
+    nvs_close(nvs);
+}
+
+/*
+ * Returns the WPA2 PMK for the network, from the NVS cache or derived with
+ * PBKDF2-HMAC-SHA1 (4096 iterations) and cached.
+ */
+esp_err_t ImprovServer::GetPmk(const char *ssid, const char *password, uint8_t *pmk)
+{
+    uint8_t id[PMK_CACHE_ID_LEN];
+    uint8_t digest[32];
+
+    esp_err_t err = pmkCacheKey(ssid, password, id, digest);
+    if (err != ESP_OK) {
+        return err;
+    }
+    if (lookupPmk(ssid, password, pmk) == ESP_OK) {
+        return ESP_OK;
+    }
+
+    int64_t start = esp_timer_get_time();
+    int rc = mbedtls_pkcs5_pbkdf2_hmac_ext(MBEDTLS_MD_SHA1, (const unsigned char *)password, strlen(password),
+        (const unsigned char *)ssid, strlen(ssid), 4096, WIFI_PMK_LEN, pmk);
+    if (rc != 0) {
+        ESP_LOGE(TAG, "PMK derivation failed, rc=%d", rc);
+        return ESP_FAIL;
+    }
+    pmkStats.derivations++;
+    pmkStats.lastDeriveUsecs = esp_timer_get_time() - start;
+    pmkStats.totalDeriveUsecs += pmkStats.lastDeriveUsecs;
+    ESP_LOGI(TAG, "Derived PMK for %s in %lld us", ssid, (long long)pmkStats.lastDeriveUsecs);
+
+    storePmk(id, digest, pmk);
+    return ESP_OK;
+}
+
+// Derives the PMKs of the newest request in the background and exits when done
+void ImprovServer::pmkTask(void *param)
+{
+    uint8_t pmk[WIFI_PMK_LEN];
+
+    while (true) {
+        xSemaphoreTake(provisionLock, portMAX_DELAY);
+        if (pmkJobs.empty()) {
+            pmkTaskHandle = NULL;
+            xSemaphoreGive(provisionLock);
+            break;
+        }
+        wifi_credential_t cred = pmkJobs.front();
+        pmkJobs.erase(pmkJobs.begin());
+        xSemaphoreGive(provisionLock);
+        GetPmk(cred.ssid.c_str(), cred.password.c_str(), pmk);
+    }
+    vTaskDelete(NULL);
+}
+
+// ESP-IDF treats a 64 hex character STA password as the PSK itself
+void ImprovServer::PmkToHex(const uint8_t *pmk, char *hex)
+{
+    for (int i = 0; i < WIFI_PMK_LEN; i++) {
+        sprintf(hex + i * 2, "%02x", pmk[i]);
+    }
+    hex[WIFI_PMK_LEN * 2] = '\0';
+}
+
+pmk_stats_t ImprovServer::GetPmkStats()
+{
+    return pmkStats;
+}
+
+session_stats_t ImprovServer::GetSessionStats()
+{
+    return sessionStats;
+}
+
+#if CONFIG_IMPROV_BONDING
+// The key store is a fixed table kept in NVS as one blob
+void ImprovServer::loadBonds()
+{
+    nvs_handle_t nvs;
+    size_t len = sizeof(bonds);
+
+    memset(bonds, 0, sizeof(bonds));
+    bondClock = 0;
+    bondStats.bonds = 0;
+    if (nvs_open(BOND_STORE_NVS_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK) {
+        return;
+    }
+    // A different size means the store size or the NimBLE key layout changed
+    if (nvs_get_blob(nvs, BOND_STORE_NVS_KEY, bonds, &len) != ESP_OK || len != sizeof(bonds)) {
+        memset(bonds, 0, sizeof(bonds));
+    }
+    nvs_close(nvs);
+
+    for (const bond_entry_t &b : bonds) {
+        if (b.lastUsed != 0) {
+            bondClock = std::max(bondClock, b.lastUsed);
+            bondStats.bonds++;
+        }
+    }
+    ESP_LOGI(TAG, "Loaded %u bonds", (unsigned)bondStats.bonds);
+}
+
+void ImprovServer::saveBonds()
+{
+    nvs_handle_t nvs;
+
+    bondStats.bonds = 0;
+    for (const bond_entry_t &b : bonds) {
+        if (b.lastUsed != 0) {
+            bondStats.bonds++;
+        }
+    }
+    if (nvs_open(BOND_STORE_NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to open NVS, bonds are not persisted");
+        return;
+    }
+    if (nvs_set_blob(nvs, BOND_STORE_NVS_KEY, bonds, sizeof(bonds)) != ESP_OK || nvs_commit(nvs) != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to save bonds");
+    }
+    nvs_close(nvs);
+}
+
+bond_entry_t *ImprovServer::findBond(const ble_addr_t *addr)
+{
+    for (bond_entry_t &b : bonds) {
+        if (b.lastUsed != 0 && ble_addr_cmp(&b.peerAddr, addr) == 0) {
+            return &b;
+        }
+    }
+    return NULL;
+}
+
+// NimBLE only stores CCCDs of bonded peers, they are kept with the bond
+int ImprovServer::storeReadCccd(const struct ble_store_key_cccd *key, struct ble_store_value_cccd *value)
+{
+    int skip = key->idx;
+    for (const bond_entry_t &b : bonds) {
+        if (b.lastUsed == 0) {
+            continue;
+        }
+        if (ble_addr_cmp(&key->peer_addr, BLE_ADDR_ANY) != 0 && ble_addr_cmp(&key->peer_addr, &b.peerAddr) != 0) {
+            continue;
+        }
+        for (size_t i = 0; i < b.cccdCount; i++) {
+            if (key->chr_val_handle != 0 && key->chr_val_handle != b.cccds[i].chr_val_handle) {
+                continue;
+            }
+            if (skip-- > 0) {
+                continue;
+            }
+            *value = b.cccds[i];
+            return 0;
+        }
+    }
+    return BLE_HS_ENOENT;
+}
+
+int ImprovServer::storeWriteCccd(const struct ble_store_value_cccd *val)
+{
+    bond_entry_t *bond = findBond(&val->peer_addr);
+    if (bond == NULL) {
+        return BLE_HS_ENOENT;
+    }
+    size_t i = 0;
+    while (i < bond->cccdCount && bond->cccds[i].chr_val_handle != val->chr_val_handle) {
+        i++;
+    }
+    if (i == BOND_STORE_CCCD_MAX) {
+        ESP_LOGW(TAG, "No room for the subscription to handle=%d", val->chr_val_handle);
+        return BLE_HS_ENOMEM;
+    }
+    if (i == bond->cccdCount) {
+        bond->cccdCount++;
+    }
+    bond->cccds[i] = *val;
+    saveBonds();
+    return 0;
+}
+
+int ImprovServer::storeDeleteCccd(const struct ble_store_key_cccd *key)
+{
+    bond_entry_t *bond = findBond(&key->peer_addr);
+    if (bond == NULL) {
+        return BLE_HS_ENOENT;
+    }
+    for (size_t i = 0; i < bond->cccdCount; i++) {
+        if (bond->cccds[i].chr_val_handle == key->chr_val_handle) {
+            bond->cccds[i] = bond->cccds[--bond->cccdCount];
+            saveBonds();
+            return 0;
+        }
+    }
+    return BLE_HS_ENOENT;
+}
+
+int ImprovServer::storeRead(int obj_type, const union ble_store_key *key, union ble_store_value *value)
+{
+    if (obj_type == BLE_STORE_OBJ_TYPE_CCCD) {
+        return storeReadCccd(&key->cccd, &value->cccd);
+    }
+    if (obj_type != BLE_STORE_OBJ_TYPE_OUR_SEC && obj_type != BLE_STORE_OBJ_TYPE_PEER_SEC) {
+        return BLE_HS_ENOENT;
+    }
+
+    const struct ble_store_key_sec *k = &key->sec;
+    int skip = k->idx;
+    for (const bond_entry_t &b : bonds) {
+        bool ours = obj_type == BLE_STORE_OBJ_TYPE_OUR_SEC;
+        const struct ble_store_value_sec *sec = ours ? &b.ourSec : &b.peerSec;
+        if (b.lastUsed == 0 || !(ours ? b.ourSecPresent : b.peerSecPresent)) {
+            continue;
+        }
+        if (ble_addr_cmp(&k->peer_addr, BLE_ADDR_ANY) != 0 && ble_addr_cmp(&k->peer_addr, &b.peerAddr) != 0) {
+            continue;
+        }
+        if (k->ediv_rand_present && (sec->ediv != k->ediv || sec->rand_num != k->rand_num)) {
+            continue;
+        }
+        if (skip-- > 0) {
+            continue;
+        }
+        value->sec = *sec;
+        return 0;
+    }
+    return BLE_HS_ENOENT;
+}
+
+// Called when pairing completes; when the store is full the least recently used bond is evicted
+int ImprovServer::storeWrite(int obj_type, const union ble_store_value *val)
+{
+    if (obj_type == BLE_STORE_OBJ_TYPE_CCCD) {
+        return storeWriteCccd(&val->cccd);
+    }
+    if (obj_type != BLE_STORE_OBJ_TYPE_OUR_SEC && obj_type != BLE_STORE_OBJ_TYPE_PEER_SEC) {
+        return 0;
+    }
+
+    bond_entry_t *bond = findBond(&val->sec.peer_addr);
+    if (bond == NULL) {
+        bond = &bonds[0];
+        for (bond_entry_t &b : bonds) {
+            if (b.lastUsed < bond->lastUsed) {
+                bond = &b;
+            }
+        }
+        if (bond->lastUsed != 0) {
+            const uint8_t *a = bond->peerAddr.val;
+            ESP_LOGI(TAG, "Bond store full, evicting %02x:%02x:%02x:%02x:%02x:%02x",
+                a[5], a[4], a[3], a[2], a[1], a[0]);
+            bondStats.evictions++;
+        }
+        memset(bond, 0, sizeof(*bond));
+        bond->peerAddr = val->sec.peer_addr;
+    }
+    if (obj_type == BLE_STORE_OBJ_TYPE_OUR_SEC) {
+        bond->ourSec = val->sec;
+        bond->ourSecPresent = true;
+    } else {
+        bond->peerSec = val->sec;
+        bond->peerSecPresent = true;
+    }
+    bond->lastUsed = ++bondClock;
+    pairedThisSession = true;
+    saveBonds();
+    return 0;
+}
+
+int ImprovServer::storeDelete(int obj_type, const union ble_store_key *key)
+{
+    if (obj_type == BLE_STORE_OBJ_TYPE_CCCD) {
+        return storeDeleteCccd(&key->cccd);
+    }
+    if (obj_type != BLE_STORE_OBJ_TYPE_OUR_SEC && obj_type != BLE_STORE_OBJ_TYPE_PEER_SEC) {
+        return BLE_HS_ENOENT;
+    }
+
+    bond_entry_t *bond = findBond(&key->sec.peer_addr);
+    if (bond == NULL) {
+        return BLE_HS_ENOENT;
+    }
+    if (obj_type == BLE_STORE_OBJ_TYPE_OUR_SEC) {
+        bond->ourSecPresent = false;
+    } else {
+        bond->peerSecPresent = false;
+    }
+    if (!bond->ourSecPresent && !bond->peerSecPresent) {
+        memset(bond, 0, sizeof(*bond));
+    }
+    saveBonds();
+    return 0;
+}
+
+int ImprovServer::storeStatus(struct ble_store_status_event *event, void *arg)
+{
+    // storeWrite() evicts by itself, so the store doesn't overflow
+    ESP_LOGW(TAG, "Unexpected bond store event %d", event->event_code);
+    return 0;
+}
+
+void ImprovServer::securityChanged(uint16_t conn_handle, int status)
+{
+    struct ble_gap_conn_desc desc;
+    int64_t elapsed = now() - securityStartedAt;
+
+    if (status != 0 || !findConn(conn_handle, &desc) || !desc.sec_state.encrypted) {
+        ESP_LOGW(TAG, "Failed to encrypt the link, status=%d", status);
+        bondStats.failures++;
+        return;
+    }
+
+    // Pairing stores new keys; a station that didn't bond pairs on every session
+    if (pairedThisSession || !desc.sec_state.bonded) {
+        bondStats.pairings++;
+        bondStats.lastPairingUsecs = elapsed;
+        bondStats.totalPairingUsecs += elapsed;
+        ESP_LOGI(TAG, "Paired in %lld us", (long long)elapsed);
+        return;
+    }
+
+    bondStats.resumptions++;
+    bondStats.lastResumeUsecs = elapsed;
+    bondStats.totalResumeUsecs += elapsed;
+    ESP_LOGI(TAG, "Resumed encryption in %lld us", (long long)elapsed);
+    bond_entry_t *bond = findBond(&desc.peer_id_addr);
+    if (bond != NULL && !replaying) {
+        bond->lastUsed = ++bondClock;
+        saveBonds();
+    }
+}
+#endif
+
+bond_stats_t ImprovServer::GetBondStats()
+{
+    return bondStats;
+}
+
+// Forgets all bonded stations, they have to pair again
+esp_err_t ImprovServer::ClearBonds()
+{
+#if CONFIG_IMPROV_BONDING
+    if (connHandle != BLE_HS_CONN_HANDLE_NONE) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    memset(bonds, 0, sizeof(bonds));
+    bondClock = 0;
+    saveBonds();
+    return ESP_OK;
+#else
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
 esp_err_t ImprovServer::initServer()
 {
     ble_svc_gap_init();
+#if !CONFIG_IMPROV_GATT_CACHING
+    // With GATT caching the server registers its own Generic Attribute service
     ble_svc_gatt_init();
+#endif
+
+    // The service table is built once and registered again on every restart
+    if (svcs != NULL) {
+        return registerServices();
+    }
 
     memset(&svc, 0, sizeof(struct ble_gatt_svc_def));
     memset(&nullSvc, 0, sizeof(struct ble_gatt_svc_def));
@@ -476,7 +2729,11 @@ esp_err_t ImprovServer::initServer()
     rpcWriteChr.access_cb = gattSvrChrRpcWrite;
     rpcWriteChr.arg = (void *)this;
     rpcWriteChr.val_handle = NULL;
+#if CONFIG_IMPROV_BONDING
+    rpcWriteChr.flags = BLE_GATT_CHR_F_WRITE | BLE_GATT_CHR_F_WRITE_ENC;
+#else
     rpcWriteChr.flags = BLE_GATT_CHR_F_WRITE;
+#endif
 
     ble_uuid128_t *rpcResultUuid = strToUuid(improv::RPC_RESULT_UUID);
     rpcResultChr.uuid = &rpcResultUuid->u;
@@ -529,11 +2786,57 @@ esp_err_t ImprovServer::initServer()
         nullChr,
     };
 
-    auto svcs = new struct ble_gatt_svc_def[] {
+#if CONFIG_IMPROV_GATT_CACHING
+    memset(&gattSvc, 0, sizeof(struct ble_gatt_svc_def));
+    memset(&svcChangedChr, 0, sizeof(struct ble_gatt_chr_def));
+    memset(&dbHashChr, 0, sizeof(struct ble_gatt_chr_def));
+
+    gattUuid = BLE_UUID16_INIT(GATT_SERVICE_UUID);
+    gattSvc.type = BLE_GATT_SVC_TYPE_PRIMARY;
+    gattSvc.uuid = &gattUuid.u;
+
+    svcChangedUuid = BLE_UUID16_INIT(GATT_SERVICE_CHANGED_UUID);
+    svcChangedChr.uuid = &svcChangedUuid.u;
+    svcChangedChr.access_cb = gattSvrChrGattService;
+    svcChangedChr.arg = (void *)this;
+    svcChangedChr.val_handle = &svcChangedHandle;
+    svcChangedChr.flags = BLE_GATT_CHR_F_INDICATE;
+
+    // No Client Supported Features: robust caching would have the server track which
+    // clients are change-aware and fail their requests, clients that read the hash
+    // and take Service Changed indications don't need it
+    dbHashUuid = BLE_UUID16_INIT(GATT_DATABASE_HASH_UUID);
+    dbHashChr.uuid = &dbHashUuid.u;
+    dbHashChr.access_cb = gattSvrChrGattService;
+    dbHashChr.arg = (void *)this;
+    dbHashChr.val_handle = &dbHashHandle;
+    dbHashChr.flags = BLE_GATT_CHR_F_READ;
+
+    gattSvc.characteristics = new struct ble_gatt_chr_def[] {
+        svcChangedChr,
+        dbHashChr,
+        nullChr,
+    };
+
+    // Registration order decides the handles, keep it fixed so the hash is stable across boots
+    svcs = new struct ble_gatt_svc_def[] {
+        gattSvc,
         svc,
         devSvc,
         nullSvc,
     };
+#else
+    svcs = new struct ble_gatt_svc_def[] {
+        svc,
+        devSvc,
+        nullSvc,
+    };
+#endif
+    return registerServices();
+}
+
+esp_err_t ImprovServer::registerServices()
+{
     int rc;
 
     rc = ble_gatts_count_cfg(svcs);
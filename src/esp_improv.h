@@ -18,7 +18,14 @@
 #include "services/gatt/ble_svc_gatt.h"
 #include "services/ans/ble_svc_ans.h"
 
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/timers.h"
+#include "esp_event.h"
+
 #include "improv.h"
+#include "improv_trace.h"
+#include "advertise_schedule.h"
 #include "esp_central.h"
 
 namespace improvserver
@@ -29,11 +36,220 @@ namespace improvserver
 #define GATT_MANUFACTURER_NAME_UUID 0x2A29
 #define GATT_MODEL_NUMBER_UUID      0x2A24
 
-#define ADVERTISE_NAME_EVERY_MSECS 5000
-#define ADVERTISE_NAME_FOR_MSECS   1000
+/* Generic Attribute service, registered by the server with CONFIG_IMPROV_GATT_CACHING */
+#define GATT_SERVICE_UUID                   0x1801
+#define GATT_SERVICE_CHANGED_UUID           0x2A05
+#define GATT_DATABASE_HASH_UUID             0x2B2A
+#define GATT_DATABASE_HASH_LEN              16
+#define GATT_DATABASE_HASH_NVS_NAMESPACE    "improv"
+#define GATT_DATABASE_HASH_NVS_KEY          "dbhash"
+
 #define AFTER_PROVISION_DELAY      2500
+#define SHUTDOWN_TASK_TIMEOUT_MSECS 2000
+/* Largest attribute value, so RPC frames (up to 258 bytes) are captured whole */
+#define TRACE_MAX_WRITE_LEN        512
+
+/* Vendor RPC carrying several WiFi credentials:
+ *   [command, length, count, (priority, ssid length, ssid, password length, password) * count, checksum]
+ * Lower priority values are tried first. */
+#define IMPROV_CMD_WIFI_SETTINGS_MULTI   0xF0
+#define MULTI_CREDENTIAL_MAX             8
+#define WIFI_RSSI_NOT_FOUND              INT8_MIN
+
+/* Vendor RPC cancelling the provisioning attempt in flight: [command, 0, checksum] */
+#define IMPROV_CMD_CANCEL_PROVISIONING   0xF1
+#define PROVISIONING_DEADLINE_MSECS      30000
+
+typedef struct {
+    size_t freeHeapBefore;
+    size_t freeHeapAfter;
+    bool controllerMemoryReleased;
+} shutdown_stats_t;
+
+// How far Shutdown() got, a failed call is picked up from here by the next one
+typedef enum {
+    SHUTDOWN_IDLE = 0,
+    SHUTDOWN_ADVERTISE_TASK,    // waiting for the advertise task to exit
+    SHUTDOWN_PROVISION_TASK,    // waiting for the provisioning callback to return
+    SHUTDOWN_STOP_HOST,         // advertising and the client dropped, nimble_port_stop() next
+    SHUTDOWN_HOST_TASK,         // waiting for the NimBLE host task to exit
+    SHUTDOWN_DEINIT,
+} shutdown_phase_t;
+
+#define ADMISSION_RSSI_DISABLED    INT8_MIN
+
+typedef struct {
+    uint32_t idleTimeoutMsecs;      // disconnect clients with no subscribe/RPC write for this long, 0 = off
+    int8_t minRssi;                 // reject connections weaker than this, ADMISSION_RSSI_DISABLED = off
+    const ble_addr_t *acceptList;   // only these stations may connect, copied by SetAdmissionPolicy()
+    size_t acceptListLen;           // 0 = anyone may connect, at most UINT8_MAX
+} admission_policy_t;
+
+typedef struct {
+    uint32_t accepted;
+    uint32_t busyRejections;
+    uint32_t idleEvictions;
+    uint32_t rssiRejections;
+    uint32_t acceptListRejections;
+} admission_stats_t;
+
+typedef struct {
+    std::string ssid;
+    std::string password;
+    uint8_t priority;
+    uint8_t index;      // position in the received list
+    int8_t rssi;        // WIFI_RSSI_NOT_FOUND if not seen or not scanned
+} wifi_credential_t;
+
+typedef struct {
+    uint32_t attempt;
+    bool multi;
+    int64_t receivedUsecs;
+    int64_t deadlineUsecs;  // armed when the request is submitted, not when it starts running
+    std::vector<wifi_credential_t> creds;
+} provision_request_t;
+
+#define TIMELINE_RING_SIZE 8
+
+// Provisioning phases, stamped by the server or by the app with StampTimeline()
+typedef enum {
+    TIMELINE_BLE_RECEIVED = 0,      // RPC write arrived (server)
+    TIMELINE_COMMAND_DECODED,       // command parsed and queued (server)
+    TIMELINE_CALLBACK_ENTERED,      // provisioning callback called (server)
+    TIMELINE_WIFI_ASSOCIATED,       // associated with the AP (app, ESP-IDF has no event for it)
+    TIMELINE_WIFI_HANDSHAKE_DONE,   // 4-way handshake completed (app or WIFI_EVENT_STA_CONNECTED)
+    TIMELINE_DHCP_LEASE,            // got a DHCP lease (app or IP_EVENT_STA_GOT_IP)
+    TIMELINE_FIRST_IP,              // first IP traffic succeeded (app)
+    TIMELINE_CALLBACK_RETURNED,     // provisioning callback returned (server)
+    TIMELINE_FINISHED,              // outcome reported to the client (server)
+    TIMELINE_PHASE_MAX,
+} timeline_phase_t;
+
+// The callback and WiFi phases, SSID and BSSID describe the last network tried,
+// which is the one that connected when the attempt succeeded
+typedef struct {
+    uint32_t attempt;
+    char ssid[33];
+    uint8_t bssid[6];
+    uint8_t candidates;     // networks tried
+    bool finished;
+    esp_err_t result;
+    int64_t stamps[TIMELINE_PHASE_MAX];    // esp_timer_get_time() usecs, 0 = not reached
+} provision_timeline_t;
+
+#define WIFI_PMK_LEN               32
+#define PMK_CACHE_NVS_NAMESPACE    "improv_pmk"
+#define PMK_CACHE_INDEX_KEY        "index"
+#define PMK_CACHE_MAX_ENTRIES      8
+#define PMK_CACHE_ID_LEN           7        // bytes of the SSID's SHA-256 in the NVS key
+
+// Passed to the provisioning callback, check with ImprovServer::IsCancelled()
+typedef struct {
+    uint32_t attempt;
+    int64_t deadlineUsecs;
+    const uint8_t *pmk;     // WPA2 PMK for the network being tried, NULL if not available
+} provision_token_t;
+
+typedef struct {
+    uint32_t attempts;
+    uint32_t succeeded;
+    uint32_t failed;
+    uint32_t timedOut;
+    uint32_t superseded;
+    uint32_t cancelled;
+} provisioning_stats_t;
+
+typedef struct {
+    uint32_t updates;           // state changes written into the running advertisement
+    uint32_t deferred;          // state changes while the name was advertised
+    int64_t lastLatencyUsecs;   // state change to advertising data accepted by the controller
+    int64_t maxLatencyUsecs;
+    int64_t airBoundUsecs;      // worst case until scanners can see the change
+} adv_update_stats_t;
+
+typedef struct {
+    uint32_t sessions;
+    uint32_t writeSessions;             // sessions that wrote an RPC
+    int64_t lastConnectToWriteUsecs;    // connect to first RPC write
+    int64_t totalConnectToWriteUsecs;
+} session_stats_t;
+
+typedef struct {
+    uint32_t hits;              // networks tried with a cached PMK
+    uint32_t misses;            // networks tried before their PMK was derived
+    uint32_t derivations;       // PBKDF2 runs, in the background
+    uint32_t evictions;         // oldest networks dropped from the cache
+    int64_t lastDeriveUsecs;    // cost of the last PBKDF2 derivation, saved on every hit
+    int64_t totalDeriveUsecs;
+} pmk_stats_t;
+
+#define BOND_STORE_NVS_NAMESPACE   "improv_bond"
+#define BOND_STORE_NVS_KEY         "bonds"
+// Status, error and RPC result notifications, Service Changed indications
+#define BOND_STORE_CCCD_MAX        4
+
+// A bonded station in the key store used with CONFIG_IMPROV_BONDING
+typedef struct {
+    ble_addr_t peerAddr;            // identity address
+    uint32_t lastUsed;              // LRU clock, 0 = free slot
+    bool ourSecPresent;
+    bool peerSecPresent;
+    struct ble_store_value_sec ourSec;
+    struct ble_store_value_sec peerSec;
+    // Subscriptions outlive the session for a bonded station, Service Changed in particular
+    uint8_t cccdCount;
+    struct ble_store_value_cccd cccds[BOND_STORE_CCCD_MAX];
+} bond_entry_t;
+
+typedef struct {
+    uint32_t bonds;                 // stations in the key store
+    uint32_t pairings;              // links encrypted by pairing
+    uint32_t resumptions;           // links encrypted with a stored key, without pairing
+    uint32_t failures;
+    uint32_t evictions;             // least recently used bonds dropped to make room
+    int64_t lastPairingUsecs;       // security request to encrypted link
+    int64_t totalPairingUsecs;
+    int64_t lastResumeUsecs;
+    int64_t totalResumeUsecs;
+} bond_stats_t;
+
+typedef struct {
+    uint32_t events;
+    uint32_t skipped;
+    uint32_t callbacks;             // provisioning callback results fed back from the capture
+    int64_t virtualDurationUsecs;   // time span covered by the capture
+    int64_t handlerUsecs;           // wall clock time spent in the server's handlers
+    int32_t freeHeapDelta;
+    improv::State finalState;
+    improv::Error finalError;
+    // The replayed sessions on their own; the server's live figures are left as they were
+    provisioning_stats_t provisioning;
+    admission_stats_t admission;
+    session_stats_t sessions;
+    pmk_stats_t pmk;
+    bond_stats_t bonds;
+} trace_replay_stats_t;
+
+// Stands in for the radio and the app's callbacks during Replay(), from what the capture recorded
+typedef struct {
+    std::vector<std::pair<size_t, uint32_t>> submits;   // RPC write record, captured attempt it submitted
+    size_t record;                          // index of the record being replayed
+    uint32_t attempt;                       // captured attempt of the request being run
+    std::vector<trace_record_t> outcomes;   // scan and callback results, in capture order
+    std::vector<bool> consumed;
+    int64_t endUsecs;                       // last record in the capture
+    struct ble_gap_conn_desc connDesc;      // link as seen by the event being replayed
+    bool connFound;
+    int8_t rssi;
+    bool rssiFound;
+    bool idleArmed;                         // idle timer running on the virtual clock
+    std::vector<uint16_t> terminated;       // links the server dropped that the capture kept going
+} replay_context_t;
 
 typedef esp_err_t (*wifi_provision_fn)(const char *ssid, const char *password, void *args);
+typedef esp_err_t (*wifi_provision_cancellable_fn)(const char *ssid, const char *password, const provision_token_t *token, void *args);
+// Fills rssi[i] for each ssids[i] from a single scan, WIFI_RSSI_NOT_FOUND if not in range
+typedef esp_err_t (*wifi_scan_fn)(const char **ssids, size_t count, int8_t *rssi, void *args);
 
 class ImprovServer 
 {
@@ -45,16 +261,48 @@ class ImprovServer
     static uint8_t capabilities;
 
     static bool advertiseName;
+    static AdvertiseScheduler scheduler;
     static improv::State state;
     static improv::Error error;
     static bool advertiseOn;
     static bool advertising;
+    static bool running;
+    static bool shutdownRequested;
+    static bool autoShutdown;
+    static bool autoShutdownReleaseMemory;
+    static bool controllerMemoryReleased;
+    static shutdown_stats_t shutdownStats;
+    static shutdown_phase_t shutdownPhase;
+    static admission_policy_t admissionPolicy;
+    static admission_stats_t admissionStats;
+    static bool acceptListDirty;
+    static TimerHandle_t idleTimer;
+    static bool replaying;
+    static replay_context_t replayCtx;
+    static int64_t lastActivityUsecs;
+    static improv::State advertisedState;
+    static adv_update_stats_t advUpdateStats;
+    static int64_t virtualNow;
+#if CONFIG_IMPROV_TRACE
+    static TraceWriter traceWriter;
+#endif
 
     static uint16_t errorHandle;
     static uint16_t statusHandle;
     static uint16_t rpcResultHandle;  
     static uint16_t capabilitiesHandle;    
     static TaskHandle_t advertiseTaskHandle;
+    static TaskHandle_t provisionTaskHandle;
+    static SemaphoreHandle_t advertiseExitSem;
+    static SemaphoreHandle_t provisionExitSem;
+    static SemaphoreHandle_t hostExitSem;
+    static SemaphoreHandle_t provisionLock;
+    static TimerHandle_t deadlineTimer;
+    static provision_request_t *pendingRequest;
+    static uint32_t activeAttempt;
+    static uint32_t deadlineAttempt;
+    static bool attemptFinished;
+    static provisioning_stats_t provisioningStats;
 
     static struct ble_gatt_svc_def svc;
     static struct ble_gatt_svc_def devSvc;
@@ -62,18 +310,69 @@ class ImprovServer
     static struct ble_gatt_chr_def statusChr, errorChr, rpcWriteChr, rpcResultChr, capabilitiesChr;
     static struct ble_gatt_chr_def devManufChr, devModelChr;
     static struct ble_gatt_chr_def nullChr;
+    static struct ble_gatt_svc_def *svcs;
+    static struct ble_gatt_svc_def gattSvc;
+    static struct ble_gatt_chr_def svcChangedChr, dbHashChr;
+    static uint16_t svcChangedHandle;
+    static uint16_t dbHashHandle;
+    static uint8_t dbHash[GATT_DATABASE_HASH_LEN];
+    static bool databaseChanged;
+    static int64_t connectedAt;
+    static bool rpcWritten;
+    static session_stats_t sessionStats;
+    static pmk_stats_t pmkStats;
+    static TaskHandle_t pmkTaskHandle;
+    static std::vector<wifi_credential_t> pmkJobs;
+    static provision_timeline_t timelines[TIMELINE_RING_SIZE];
+    static size_t timelineCount;
+    static portMUX_TYPE timelineMux;
+    static uint32_t bondClock;
+    static int64_t securityStartedAt;
+    static bool pairedThisSession;
+    static bond_stats_t bondStats;
 
     static ble_uuid128_t *serviceUuid;
     ble_uuid16_t infoUuid;
     ble_uuid16_t manufUuid;
     ble_uuid16_t modelUuid;
+    ble_uuid16_t gattUuid;
+    ble_uuid16_t svcChangedUuid;
+    ble_uuid16_t dbHashUuid;
 
     static esp_err_t gapEvent(struct ble_gap_event *event, void *arg);
     static esp_err_t advertise();
+    static int setAdvertisingFields();
+    static void updateAdvertisingData();
     static void hostTask(void *param);
     static void advertiseTask(void *param);
+    static void shutdownTask(void *param);
+    static void provisionTask(void *param);
+    static void deadlineTimerCallback(TimerHandle_t timer);
+    static void openTimeline(const provision_request_t *req);
+    static void stampTimeline(uint32_t attempt, timeline_phase_t phase, esp_err_t result);
+    static void startTimelineCandidate(uint32_t attempt, const wifi_credential_t *cred);
+    static void wifiEventHandler(void *arg, esp_event_base_t base, int32_t id, void *data);
+    static bool finishAttempt(uint32_t attempt, esp_err_t err, const wifi_credential_t *cred, bool multi);
+    static bool advertiseWait(uint32_t msecs);
     static void onSync();
     static void onReset(int reason);
+    static bool admitClient(uint16_t handle, uint8_t *reason);
+    static void rejectClient(uint16_t handle, uint8_t reason);
+    static void clientActivity();
+    static void idleTimerCallback(TimerHandle_t timer);
+    static int64_t now();
+    static void traceRecord(uint8_t type, uint16_t conn, uint16_t attr, const uint8_t *payload, size_t len);
+    static void traceGapEvent(struct ble_gap_event *event);
+    static void traceGattAccess(trace_chr_t chr, uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt);
+    static bool replayGapEvent(const trace_record_t *rec);
+    static bool replayGattAccess(const trace_record_t *rec);
+    static void replayIdleTimer(int64_t until);
+    static bool replayScan(int8_t *rssi, size_t count, esp_err_t *err);
+    static bool replayProvisioning(const provision_token_t *token, const wifi_credential_t *cred, esp_err_t *err);
+    static bool findConn(uint16_t conn_handle, struct ble_gap_conn_desc *desc);
+    static int connRssi(uint16_t conn_handle, int8_t *rssi);
+    static int terminateConn(uint16_t conn_handle, uint8_t reason);
+    static bool replayTerminated(const trace_record_t *rec);
 
     static int gattSvrChrDeviceInfo(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg);
     static int gatt_svr_chr_test(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg);
@@ -81,23 +380,64 @@ class ImprovServer
     static int gattSvrChrError(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg);
     static int gattSvrChrRpcWrite(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg);
     static int gattSvrChrRpcResult(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg);
+    static int gattSvrChrGattService(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg);
     static int gattSvrChrCapabilities(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg);
 
     static int gattSvrChrStatusNotify();
     static int gattSvrChrErrorNotify();
+    static int gattSvrChrRpcResultNotify();
+#if CONFIG_IMPROV_GATT_CACHING
+    static esp_err_t computeDatabaseHash();
+    static void checkDatabaseChanged();
+    static void serviceChangedSubscribed(uint16_t conn_handle);
+    static void serviceChangedConfirmed();
+#endif
+    static esp_err_t pmkCacheKey(const char *ssid, const char *password, uint8_t *id, uint8_t *digest);
+    static void pmkCacheKeyName(const uint8_t *id, char *key);
+    static esp_err_t lookupPmk(const char *ssid, const char *password, uint8_t *pmk);
+    static void storePmk(const uint8_t *id, const uint8_t *digest, const uint8_t *pmk);
+    static void pmkTask(void *param);
+    static void loadBonds();
+    static void saveBonds();
+    static bond_entry_t *findBond(const ble_addr_t *addr);
+    static int storeReadCccd(const struct ble_store_key_cccd *key, struct ble_store_value_cccd *value);
+    static int storeWriteCccd(const struct ble_store_value_cccd *val);
+    static int storeDeleteCccd(const struct ble_store_key_cccd *key);
+    static int storeRead(int obj_type, const union ble_store_key *key, union ble_store_value *value);
+    static int storeWrite(int obj_type, const union ble_store_value *val);
+    static int storeDelete(int obj_type, const union ble_store_key *key);
+    static int storeStatus(struct ble_store_status_event *event, void *arg);
+    static void securityChanged(uint16_t conn_handle, int status);
+    static bool parseCredentialList(const uint8_t *data, size_t len, std::vector<wifi_credential_t> &creds);
+
+    static std::vector<uint8_t> rpcResult;
 
     wifi_provision_fn onProvision;
     void *onProvisionArgs;
+    wifi_scan_fn onScan;
+    void *onScanArgs;
+    wifi_provision_cancellable_fn onProvisionCancellable;
+    uint32_t provisioningDeadlineMsecs;
 
     esp_err_t initServer();
+    esp_err_t startStack();
+    esp_err_t registerServices();
     static ble_uuid128_t *strToUuid(const char *uuidStr);
-    esp_err_t onWifiProvisioning(const char *ssid, const char *password, void *args);
+    esp_err_t onWifiProvisioning(const char *ssid, const char *password, const provision_token_t *token, void *args);
+    void submitRequest(provision_request_t *req);
+    void runAttempt(provision_request_t *req);
 
     public:
     static uint8_t addrType;
     static uint16_t connHandle;
 
     ImprovServer(const char *btname, const char *manufacturer, const char *model) {
+        onProvision = NULL;
+        onProvisionArgs = NULL;
+        onScan = NULL;
+        onScanArgs = NULL;
+        onProvisionCancellable = NULL;
+        provisioningDeadlineMsecs = PROVISIONING_DEADLINE_MSECS;
         ImprovServer::manufacturerName = new std::string(manufacturer);
         ImprovServer::modelName = new std::string(model);
         ImprovServer::deviceName = new std::string(btname);
@@ -108,8 +448,34 @@ class ImprovServer
         delete ImprovServer::deviceName;
     }
     esp_err_t Initialize(wifi_provision_fn onProvisionCallback, void *args);
+    esp_err_t Initialize(wifi_provision_cancellable_fn onProvisionCallback, void *args);
     esp_err_t StopAdvertising();
     esp_err_t StartAdvertising();
+    esp_err_t Shutdown(bool releaseControllerMemory);
+    esp_err_t Restart();
+    void SetAutoShutdown(bool enable, bool releaseControllerMemory);
+    shutdown_stats_t GetShutdownStats();
+    esp_err_t SetAdmissionPolicy(const admission_policy_t *policy);
+    admission_stats_t GetAdmissionStats();
+    void SetScanCallback(wifi_scan_fn onScanCallback, void *args);
+    void SetProvisioningDeadline(uint32_t msecs);
+    esp_err_t CancelProvisioning();
+    provisioning_stats_t GetProvisioningStats();
+    adv_update_stats_t GetAdvertisingUpdateStats();
+    session_stats_t GetSessionStats();
+    pmk_stats_t GetPmkStats();
+    static esp_err_t GetPmk(const char *ssid, const char *password, uint8_t *pmk);
+    static void PmkToHex(const uint8_t *pmk, char *hex);
+    bond_stats_t GetBondStats();
+    esp_err_t ClearBonds();
+    static void StampTimeline(timeline_phase_t phase);
+    static size_t GetTimelines(provision_timeline_t *out, size_t max);
+    static void LogTimelines();
+    esp_err_t EnableWifiEventTimeline();
+    static bool IsCancelled(const provision_token_t *token);
+    esp_err_t GetTrace(const uint8_t **capture, size_t *len, uint32_t *dropped);
+    esp_err_t ClearTrace();
+    esp_err_t Replay(const uint8_t *capture, size_t len, trace_replay_stats_t *stats);
 };
 
 } 
@@ -0,0 +1,167 @@
+/*
+ * SPDX-FileCopyrightText: 2025 Taneli Leppä
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+#include <string.h>
+#include "improv_trace.h"
+
+namespace improvserver
+{
+
+static size_t varintLen(uint64_t v)
+{
+    size_t n = 1;
+    while (v >= 0x80) {
+        v >>= 7;
+        n++;
+    }
+    return n;
+}
+
+static uint8_t *putVarint(uint8_t *p, uint64_t v)
+{
+    while (v >= 0x80) {
+        *p++ = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (uint8_t)v;
+    return p;
+}
+
+static bool getVarint(const uint8_t *buf, size_t len, size_t *pos, uint64_t *v)
+{
+    uint64_t result = 0;
+    for (int shift = 0; shift < 64 && *pos < len; shift += 7) {
+        uint8_t b = buf[(*pos)++];
+        result |= (uint64_t)(b & 0x7f) << shift;
+        if ((b & 0x80) == 0) {
+            *v = result;
+            return true;
+        }
+    }
+    return false;
+}
+
+TraceWriter::TraceWriter(uint8_t *buffer, size_t bufferSize)
+{
+    buf = buffer;
+    size = bufferSize;
+    Clear();
+}
+
+void TraceWriter::Clear()
+{
+    len = 0;
+    lastTimestamp = 0;
+    dropped = 0;
+    if (size >= TRACE_HEADER_LEN) {
+        memcpy(buf, TRACE_MAGIC, 4);
+        buf[4] = TRACE_VERSION;
+        len = TRACE_HEADER_LEN;
+    }
+}
+
+bool TraceWriter::Append(const trace_record_t *rec)
+{
+    // The first record carries the absolute timestamp
+    uint64_t delta = rec->timestampUsecs > lastTimestamp ? rec->timestampUsecs - lastTimestamp : 0;
+
+    size_t needed = 5 + varintLen(delta) + varintLen(rec->payloadLen) + rec->payloadLen;
+    if (len < TRACE_HEADER_LEN || size - len < needed) {
+        dropped++;
+        return false;
+    }
+
+    uint8_t *p = buf + len;
+    *p++ = rec->type;
+    *p++ = rec->connHandle & 0xff;
+    *p++ = rec->connHandle >> 8;
+    *p++ = rec->attrHandle & 0xff;
+    *p++ = rec->attrHandle >> 8;
+    p = putVarint(p, delta);
+    p = putVarint(p, rec->payloadLen);
+    if (rec->payloadLen > 0) {
+        memcpy(p, rec->payload, rec->payloadLen);
+        p += rec->payloadLen;
+    }
+    len = p - buf;
+    // A record older than the last one went in with a zero delta, don't move the
+    // base back or every later record would decode late
+    if (rec->timestampUsecs > lastTimestamp) {
+        lastTimestamp = rec->timestampUsecs;
+    }
+    return true;
+}
+
+TraceReader::TraceReader(const uint8_t *capture, size_t captureLen)
+{
+    buf = capture;
+    len = captureLen;
+    pos = TRACE_HEADER_LEN;
+    timestamp = 0;
+}
+
+bool TraceReader::Valid()
+{
+    return len >= TRACE_HEADER_LEN && memcmp(buf, TRACE_MAGIC, 4) == 0 && buf[4] == TRACE_VERSION;
+}
+
+bool TraceReader::Next(trace_record_t *rec)
+{
+    uint64_t delta, payloadLen;
+
+    if (!Valid() || len - pos < 5) {
+        return false;
+    }
+    size_t p = pos;
+    rec->type = buf[p];
+    rec->connHandle = buf[p + 1] | (buf[p + 2] << 8);
+    rec->attrHandle = buf[p + 3] | (buf[p + 4] << 8);
+    p += 5;
+    if (!getVarint(buf, len, &p, &delta) || !getVarint(buf, len, &p, &payloadLen)) {
+        return false;
+    }
+    if (len - p < payloadLen) {
+        return false;
+    }
+    rec->payload = payloadLen > 0 ? buf + p : NULL;
+    rec->payloadLen = payloadLen;
+    timestamp += delta;
+    rec->timestampUsecs = timestamp;
+    pos = p + payloadLen;
+    return true;
+}
+
+const char *trace_record_type_str(uint8_t type)
+{
+    switch (type) {
+    case TRACE_GAP_CONNECT:
+        return "connect";
+    case TRACE_GAP_DISCONNECT:
+        return "disconnect";
+    case TRACE_GAP_ADV_COMPLETE:
+        return "adv_complete";
+    case TRACE_GAP_SUBSCRIBE:
+        return "subscribe";
+    case TRACE_GAP_MTU:
+        return "mtu";
+    case TRACE_GATT_ACCESS:
+        return "gatt_access";
+    case TRACE_GAP_ENC_CHANGE:
+        return "enc_change";
+    case TRACE_GAP_REPEAT_PAIRING:
+        return "repeat_pairing";
+    case TRACE_GAP_NOTIFY_TX:
+        return "notify_tx";
+    case TRACE_PROVISION_SUBMIT:
+        return "prov_submit";
+    case TRACE_PROVISION_SCAN:
+        return "prov_scan";
+    case TRACE_PROVISION_RESULT:
+        return "prov_result";
+    }
+    return "unknown";
+}
+
+}
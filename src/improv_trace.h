@@ -0,0 +1,103 @@
+/*
+ * SPDX-FileCopyrightText: 2025 Taneli Leppä
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+#ifndef _IMPROV_TRACE_H
+#define _IMPROV_TRACE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Capture format for GAP/GATT event traces. Kept free of ESP-IDF dependencies so
+// the same code can decode captures on the host (see tools/improv_trace_dump.cpp).
+//
+// A capture is a 5 byte header ("IMPT" + version) followed by records:
+//   type (u8), conn handle (u16 LE), attr handle (u16 LE),
+//   time since previous record in usecs (varint), payload length (varint), payload
+
+namespace improvserver
+{
+
+#define TRACE_MAGIC   "IMPT"
+#define TRACE_VERSION 1
+#define TRACE_HEADER_LEN 5
+
+enum trace_record_type_t : uint8_t {
+    TRACE_GAP_CONNECT = 1,      // payload: status (i32 LE), then if the link was found:
+                                //   peer identity address type, address (6), RSSI (i8), RSSI read
+    TRACE_GAP_DISCONNECT,       // payload: reason (i32 LE)
+    TRACE_GAP_ADV_COMPLETE,     // payload: reason (i32 LE)
+    TRACE_GAP_SUBSCRIBE,        // payload: reason, cur_notify, cur_indicate
+    TRACE_GAP_MTU,              // payload: mtu (u16 LE)
+    TRACE_GATT_ACCESS,          // payload: trace_chr_t, access op, written data
+    TRACE_GAP_ENC_CHANGE,       // payload: status (i32 LE), then if the link was found:
+                                //   encrypted, bonded, peer identity address type, address (6),
+                                //   keys stored this session
+    TRACE_GAP_REPEAT_PAIRING,   // no payload
+    TRACE_GAP_NOTIFY_TX,        // payload: status (i32 LE), indication; only indications are recorded
+    TRACE_PROVISION_SUBMIT,     // payload: attempt (u32 LE)
+    TRACE_PROVISION_SCAN,       // payload: attempt (u32 LE), result (i32 LE), RSSI (i8) of each network as received
+    TRACE_PROVISION_RESULT,     // payload: attempt (u32 LE), network index, callback result (i32 LE)
+};
+
+enum trace_chr_t : uint8_t {
+    TRACE_CHR_STATUS = 0,
+    TRACE_CHR_ERROR,
+    TRACE_CHR_RPC_WRITE,
+    TRACE_CHR_RPC_RESULT,
+    TRACE_CHR_CAPABILITIES,
+    TRACE_CHR_MANUFACTURER,
+    TRACE_CHR_MODEL,
+    TRACE_CHR_SVC_CHANGED,
+    TRACE_CHR_DB_HASH,
+};
+
+typedef struct {
+    uint8_t type;
+    uint16_t connHandle;
+    uint16_t attrHandle;
+    int64_t timestampUsecs;
+    const uint8_t *payload;
+    size_t payloadLen;
+} trace_record_t;
+
+class TraceWriter
+{
+    protected:
+    uint8_t *buf;
+    size_t size;
+    size_t len;
+    int64_t lastTimestamp;
+    uint32_t dropped;
+
+    public:
+    TraceWriter(uint8_t *buffer, size_t bufferSize);
+    void Clear();
+    // Returns false (and counts the record as dropped) when the buffer is full
+    bool Append(const trace_record_t *rec);
+    const uint8_t *Data() { return buf; }
+    size_t Length() { return len; }
+    uint32_t Dropped() { return dropped; }
+};
+
+class TraceReader
+{
+    protected:
+    const uint8_t *buf;
+    size_t len;
+    size_t pos;
+    int64_t timestamp;
+
+    public:
+    TraceReader(const uint8_t *capture, size_t captureLen);
+    bool Valid();
+    // Returns false at the end of the capture or on a truncated record
+    bool Next(trace_record_t *rec);
+};
+
+const char *trace_record_type_str(uint8_t type);
+
+}
+#endif
@@ -0,0 +1,162 @@
+/*
+ * SPDX-FileCopyrightText: 2025 Taneli Leppä
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+// Virtual-time simulator for how long scanners take to discover the Improv
+// service UUID and the device name under the advertising schedule. Runs the
+// same AdvertiseScheduler as the server, against a model of the advertiser
+// (interval + 0-10 ms advDelay, channels 37/38/39, stop/start gap between
+// slots) and of common scanner duty cycles.
+//
+// Build: g++ -std=c++17 -O2 -Isrc -o adv_discovery_sim tools/adv_discovery_sim.cpp src/advertise_schedule.cpp
+// Usage: adv_discovery_sim [trials] [adv interval ms] [name every ms] [name for ms] [loss 0..1]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <random>
+#include <vector>
+#include "advertise_schedule.h"
+
+using namespace improvserver;
+
+#define SIM_HORIZON_MSECS   60000.0
+#define ADV_DELAY_MAX_MSECS 10.0
+#define ADV_CHANNEL_MSECS   0.4     // spacing of the three packets in an event
+#define ADV_RESTART_MSECS   2.0     // ble_gap_adv_stop() + ble_gap_adv_start()
+
+typedef struct {
+    const char *name;
+    double intervalMsecs;
+    double windowMsecs;
+} scanner_profile_t;
+
+static const scanner_profile_t profiles[] = {
+    { "android-low-latency", 4096 * 0.625, 4096 * 0.625 },
+    { "android-balanced",    4096 * 0.625, 1024 * 0.625 },
+    { "android-low-power",   5120 * 0.625,  512 * 0.625 },
+    { "ios-foreground",        40.0,         30.0 },
+};
+
+typedef struct {
+    double at;
+    int channel;        // 0..2 for 37..39
+    adv_payload_t payload;
+} adv_packet_t;
+
+static std::vector<adv_packet_t> advertiserTimeline(AdvertiseScheduler &scheduler, double intervalMsecs,
+    double horizon, std::mt19937 &rng)
+{
+    std::uniform_real_distribution<double> advDelay(0.0, ADV_DELAY_MAX_MSECS);
+    std::vector<adv_packet_t> packets;
+
+    scheduler.Reset();
+    double slotStart = 0.0;
+    while (slotStart < horizon) {
+        adv_slot_t slot = scheduler.Next();
+        double slotEnd = slotStart + slot.durationMsecs;
+        for (double t = slotStart; t < slotEnd && t < horizon; t += intervalMsecs + advDelay(rng)) {
+            for (int ch = 0; ch < 3; ch++) {
+                packets.push_back({ t + ch * ADV_CHANNEL_MSECS, ch, slot.payload });
+            }
+        }
+        slotStart = slotEnd + ADV_RESTART_MSECS;
+        if (slot.durationMsecs == 0) {
+            break;
+        }
+    }
+    return packets;
+}
+
+static bool scannerHears(const scanner_profile_t *p, double scanStart, const adv_packet_t &pkt)
+{
+    double rel = pkt.at - scanStart;
+    if (rel < 0) {
+        return false;
+    }
+    long n = (long)(rel / p->intervalMsecs);
+    double inInterval = rel - n * p->intervalMsecs;
+    return inInterval < p->windowMsecs && (n % 3) == pkt.channel;
+}
+
+static double percentile(std::vector<double> &v, double q)
+{
+    if (v.empty()) {
+        return 0.0;
+    }
+    size_t i = std::min(v.size() - 1, (size_t)(q * (v.size() - 1) + 0.5));
+    return v[i];
+}
+
+static void report(const char *what, std::vector<double> &found, int trials)
+{
+    std::sort(found.begin(), found.end());
+    printf("  %-8s p50 %8.0f  p90 %8.0f  p99 %8.0f  max %8.0f ms  undiscovered %5.1f%%\n", what,
+        percentile(found, 0.5), percentile(found, 0.9), percentile(found, 0.99),
+        found.empty() ? 0.0 : found.back(), 100.0 * (trials - (int)found.size()) / trials);
+}
+
+int main(int argc, char **argv)
+{
+    int trials = argc > 1 ? atoi(argv[1]) : 2000;
+    double intervalMsecs = argc > 2 ? atof(argv[2]) : 30.0;    // BLE_GAP_ADV_FAST_INTERVAL1_MIN
+    uint32_t nameEvery = argc > 3 ? atoi(argv[3]) : ADVERTISE_NAME_EVERY_MSECS;
+    uint32_t nameFor = argc > 4 ? atoi(argv[4]) : ADVERTISE_NAME_FOR_MSECS;
+    double loss = argc > 5 ? atof(argv[5]) : 0.0;
+
+    if (trials <= 0 || intervalMsecs <= 0 || nameEvery == 0) {
+        fprintf(stderr, "usage: %s [trials] [adv interval ms] [name every ms] [name for ms] [loss 0..1]\n", argv[0]);
+        return 2;
+    }
+
+    AdvertiseScheduler scheduler(nameEvery, nameFor);
+    double cycle = nameEvery + nameFor + (nameFor > 0 ? 2 * ADV_RESTART_MSECS : ADV_RESTART_MSECS);
+
+    printf("adv interval %.1f ms, name every %u ms for %u ms, loss %.0f%%, %d trials\n",
+        intervalMsecs, nameEvery, nameFor, loss * 100, trials);
+
+    for (const scanner_profile_t &p : profiles) {
+        std::mt19937 rng(1);
+        std::uniform_real_distribution<double> phase(0.0, cycle);
+        std::uniform_real_distribution<double> uniform(0.0, 1.0);
+        std::vector<double> serviceFound, nameFound;
+
+        for (int i = 0; i < trials; i++) {
+            // The user starts scanning at an arbitrary point of the rotation
+            double scanStart = phase(rng);
+            std::vector<adv_packet_t> packets = advertiserTimeline(scheduler, intervalMsecs,
+                scanStart + SIM_HORIZON_MSECS, rng);
+            double service = -1, name = -1;
+
+            for (const adv_packet_t &pkt : packets) {
+                if (!scannerHears(&p, scanStart, pkt) || uniform(rng) < loss) {
+                    continue;
+                }
+                double latency = pkt.at - scanStart;
+                if (pkt.payload == ADV_PAYLOAD_SERVICE && service < 0) {
+                    service = latency;
+                } else if (pkt.payload == ADV_PAYLOAD_NAME && name < 0) {
+                    name = latency;
+                }
+                if (service >= 0 && (name >= 0 || nameFor == 0)) {
+                    break;
+                }
+            }
+            if (service >= 0) {
+                serviceFound.push_back(service);
+            }
+            if (name >= 0) {
+                nameFound.push_back(name);
+            }
+        }
+
+        printf("%s (window %.0f / interval %.0f ms)\n", p.name, p.windowMsecs, p.intervalMsecs);
+        report("service", serviceFound, trials);
+        if (nameFor > 0) {
+            report("name", nameFound, trials);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,505 @@
+/*
+ * SPDX-FileCopyrightText: 2025 Taneli Leppä
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+#include <time.h>
+#include <map>
+#include <malloc.h>
+#include "host_shim.h"
+
+int host_shim_log_level = 2;
+
+esp_event_base_t WIFI_EVENT = "WIFI_EVENT";
+esp_event_base_t IP_EVENT = "IP_EVENT";
+const ble_addr_t ble_addr_any = {};
+struct ble_hs_cfg ble_hs_cfg;
+
+/* System */
+
+// Notional heap so allocations show up in the free size like on the device
+#define HOST_HEAP_SIZE (64 * 1024 * 1024)
+
+uint32_t esp_get_free_heap_size()
+{
+    struct mallinfo2 info = mallinfo2();
+    return info.uordblks < HOST_HEAP_SIZE ? HOST_HEAP_SIZE - info.uordblks : 0;
+}
+
+const char *esp_get_idf_version()
+{
+    return "host";
+}
+
+int64_t esp_timer_get_time()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+esp_err_t esp_event_handler_register(esp_event_base_t base, int32_t id, esp_event_handler_t handler, void *arg)
+{
+    return ESP_OK;
+}
+
+esp_err_t esp_bt_mem_release(esp_bt_mode_t mode)
+{
+    return ESP_OK;
+}
+
+/* FreeRTOS: nothing runs in the background, Replay() calls the handlers directly */
+
+typedef struct {
+    bool mutex;
+    bool given;
+} host_semaphore_t;
+
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack, void *param, UBaseType_t prio, TaskHandle_t *handle)
+{
+    static int tasks;
+
+    if (handle != NULL) {
+        *handle = (TaskHandle_t)(intptr_t)++tasks;
+    }
+    return pdPASS;
+}
+
+void vTaskDelete(TaskHandle_t task)
+{
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t wait)
+{
+    return 0;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task)
+{
+    return pdPASS;
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary()
+{
+    return new host_semaphore_t { false, false };
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex()
+{
+    return new host_semaphore_t { true, true };
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t wait)
+{
+    host_semaphore_t *s = (host_semaphore_t *)sem;
+
+    // Single threaded, so a mutex is always free
+    if (s->mutex) {
+        return pdTRUE;
+    }
+    if (!s->given) {
+        return pdFALSE;
+    }
+    s->given = false;
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem)
+{
+    ((host_semaphore_t *)sem)->given = true;
+    return pdTRUE;
+}
+
+TimerHandle_t xTimerCreate(const char *name, TickType_t period, UBaseType_t reload, void *id, TimerCallbackFunction_t fn)
+{
+    return (TimerHandle_t)fn;
+}
+
+BaseType_t xTimerReset(TimerHandle_t timer, TickType_t wait)
+{
+    return pdPASS;
+}
+
+BaseType_t xTimerStop(TimerHandle_t timer, TickType_t wait)
+{
+    return pdPASS;
+}
+
+BaseType_t xTimerChangePeriod(TimerHandle_t timer, TickType_t period, TickType_t wait)
+{
+    return pdPASS;
+}
+
+/* NVS, in memory */
+
+static std::map<std::string, std::map<std::string, std::vector<uint8_t>>> nvsData;
+static std::vector<std::string> nvsHandles;
+
+esp_err_t nvs_open(const char *ns, nvs_open_mode_t mode, nvs_handle_t *handle)
+{
+    if (mode == NVS_READONLY && nvsData.find(ns) == nvsData.end()) {
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+    nvsData[ns];
+    nvsHandles.push_back(ns);
+    *handle = nvsHandles.size();
+    return ESP_OK;
+}
+
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char *key, void *value, size_t *len)
+{
+    auto &keys = nvsData[nvsHandles[handle - 1]];
+    auto it = keys.find(key);
+
+    if (it == keys.end()) {
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+    if (value == NULL) {
+        *len = it->second.size();
+        return ESP_OK;
+    }
+    if (*len < it->second.size()) {
+        return ESP_ERR_NVS_INVALID_LENGTH;
+    }
+    memcpy(value, it->second.data(), it->second.size());
+    *len = it->second.size();
+    return ESP_OK;
+}
+
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char *key, const void *value, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)value;
+    nvsData[nvsHandles[handle - 1]][key].assign(p, p + len);
+    return ESP_OK;
+}
+
+esp_err_t nvs_erase_key(nvs_handle_t handle, const char *key)
+{
+    return nvsData[nvsHandles[handle - 1]].erase(key) > 0 ? ESP_OK : ESP_ERR_NVS_NOT_FOUND;
+}
+
+esp_err_t nvs_commit(nvs_handle_t handle)
+{
+    return ESP_OK;
+}
+
+void nvs_close(nvs_handle_t handle)
+{
+}
+
+/* mbedtls: not available on the host */
+
+const mbedtls_cipher_info_t *mbedtls_cipher_info_from_type(mbedtls_cipher_type_t type)
+{
+    return NULL;
+}
+
+int mbedtls_cipher_cmac(const mbedtls_cipher_info_t *info, const unsigned char *key, size_t keybits,
+    const unsigned char *input, size_t ilen, unsigned char *output)
+{
+    return -1;
+}
+
+int mbedtls_pkcs5_pbkdf2_hmac_ext(mbedtls_md_type_t md, const unsigned char *password, size_t plen,
+    const unsigned char *salt, size_t slen, unsigned int iterations, uint32_t keylen, unsigned char *output)
+{
+    return -1;
+}
+
+void mbedtls_sha256_init(mbedtls_sha256_context *ctx)
+{
+}
+
+int mbedtls_sha256_starts(mbedtls_sha256_context *ctx, int is224)
+{
+    return -1;
+}
+
+int mbedtls_sha256_update(mbedtls_sha256_context *ctx, const unsigned char *input, size_t ilen)
+{
+    return -1;
+}
+
+int mbedtls_sha256_finish(mbedtls_sha256_context *ctx, unsigned char *output)
+{
+    return -1;
+}
+
+void mbedtls_sha256_free(mbedtls_sha256_context *ctx)
+{
+}
+
+int mbedtls_sha256(const unsigned char *input, size_t ilen, unsigned char *output, int is224)
+{
+    return -1;
+}
+
+/* NimBLE: UUIDs and mbufs */
+
+uint16_t ble_uuid_u16(const ble_uuid_t *uuid)
+{
+    return uuid->type == BLE_UUID_TYPE_16 ? ((const ble_uuid16_t *)uuid)->value : 0;
+}
+
+int ble_uuid_cmp(const ble_uuid_t *a, const ble_uuid_t *b)
+{
+    if (a->type != b->type) {
+        return (int)a->type - (int)b->type;
+    }
+    if (a->type == BLE_UUID_TYPE_16) {
+        return (int)ble_uuid_u16(a) - (int)ble_uuid_u16(b);
+    }
+    return memcmp(((const ble_uuid128_t *)a)->value, ((const ble_uuid128_t *)b)->value, 16);
+}
+
+char *ble_uuid_to_str(const ble_uuid_t *uuid, char *dst)
+{
+    if (uuid->type == BLE_UUID_TYPE_16) {
+        sprintf(dst, "0x%04x", ble_uuid_u16(uuid));
+        return dst;
+    }
+    const uint8_t *u = ((const ble_uuid128_t *)uuid)->value;
+    sprintf(dst, "%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x",
+        u[15], u[14], u[13], u[12], u[11], u[10], u[9], u[8], u[7], u[6], u[5], u[4], u[3], u[2], u[1], u[0]);
+    return dst;
+}
+
+struct os_mbuf *ble_hs_mbuf_from_flat(const void *buf, uint16_t len)
+{
+    struct os_mbuf *om = new os_mbuf { NULL, 0 };
+    if (os_mbuf_append(om, buf, len) != 0) {
+        delete om;
+        return NULL;
+    }
+    return om;
+}
+
+int ble_hs_mbuf_to_flat(const struct os_mbuf *om, void *flat, uint16_t max_len, uint16_t *out_copy_len)
+{
+    uint16_t len = om->om_len < max_len ? om->om_len : max_len;
+
+    memcpy(flat, om->om_data, len);
+    if (out_copy_len != NULL) {
+        *out_copy_len = len;
+    }
+    return len < om->om_len ? BLE_HS_EMSGSIZE : 0;
+}
+
+int os_mbuf_append(struct os_mbuf *om, const void *data, uint16_t len)
+{
+    if (len == 0) {
+        return 0;
+    }
+    uint8_t *p = (uint8_t *)realloc(om->om_data, om->om_len + len);
+    if (p == NULL) {
+        return BLE_HS_ENOMEM;
+    }
+    memcpy(p + om->om_len, data, len);
+    om->om_data = p;
+    om->om_len += len;
+    return 0;
+}
+
+int os_mbuf_free_chain(struct os_mbuf *om)
+{
+    if (om != NULL) {
+        free(om->om_data);
+        delete om;
+    }
+    return 0;
+}
+
+/* NimBLE: host and GAP, there are never any links */
+
+int ble_addr_cmp(const ble_addr_t *a, const ble_addr_t *b)
+{
+    if (a->type != b->type) {
+        return (int)a->type - (int)b->type;
+    }
+    return memcmp(a->val, b->val, sizeof(a->val));
+}
+
+int ble_hs_id_infer_auto(int privacy, uint8_t *own_addr_type)
+{
+    *own_addr_type = BLE_OWN_ADDR_PUBLIC;
+    return 0;
+}
+
+int ble_hs_id_copy_addr(uint8_t id_addr_type, uint8_t *out_id_addr, int *out_is_nrpa)
+{
+    memset(out_id_addr, 0, 6);
+    if (out_is_nrpa != NULL) {
+        *out_is_nrpa = 0;
+    }
+    return 0;
+}
+
+static bool advActive;
+
+int ble_gap_adv_set_fields(const struct ble_hs_adv_fields *fields)
+{
+    return 0;
+}
+
+int ble_gap_adv_start(uint8_t own_addr_type, const ble_addr_t *direct_addr, int32_t duration_ms,
+    const struct ble_gap_adv_params *params, ble_gap_event_fn *cb, void *cb_arg)
+{
+    advActive = true;
+    return 0;
+}
+
+int ble_gap_adv_stop()
+{
+    if (!advActive) {
+        return BLE_HS_EALREADY;
+    }
+    advActive = false;
+    return 0;
+}
+
+int ble_gap_adv_active()
+{
+    return advActive;
+}
+
+int ble_gap_terminate(uint16_t conn_handle, uint8_t reason)
+{
+    return BLE_HS_ENOTCONN;
+}
+
+int ble_gap_conn_find(uint16_t handle, struct ble_gap_conn_desc *out_desc)
+{
+    return BLE_HS_ENOTCONN;
+}
+
+int ble_gap_conn_rssi(uint16_t conn_handle, int8_t *out_rssi)
+{
+    return BLE_HS_ENOTCONN;
+}
+
+int ble_gap_wl_set(const ble_addr_t *addrs, uint8_t white_list_count)
+{
+    return 0;
+}
+
+int ble_gap_security_initiate(uint16_t conn_handle)
+{
+    return BLE_HS_ENOTCONN;
+}
+
+int ble_store_util_delete_peer(const ble_addr_t *peer_id_addr)
+{
+    return 0;
+}
+
+/* NimBLE: GATT server, handles are assigned in registration order like NimBLE does */
+
+typedef struct {
+    const ble_uuid_t *uuid;
+    uint16_t handle;
+    std::vector<std::pair<const ble_uuid_t *, uint16_t>> chrs;     // value handles
+} host_svc_t;
+
+static std::vector<host_svc_t> gattServices;
+static uint16_t nextHandle = 1;
+
+int ble_gatts_count_cfg(const struct ble_gatt_svc_def *defs)
+{
+    return 0;
+}
+
+int ble_gatts_add_svcs(const struct ble_gatt_svc_def *svcs)
+{
+    for (const struct ble_gatt_svc_def *s = svcs; s->type != 0; s++) {
+        host_svc_t svc = { s->uuid, nextHandle++, {} };
+        for (const struct ble_gatt_chr_def *c = s->characteristics; c != NULL && c->uuid != NULL; c++) {
+            nextHandle++;
+            uint16_t valHandle = nextHandle++;
+            if (c->flags & (BLE_GATT_CHR_F_NOTIFY | BLE_GATT_CHR_F_INDICATE)) {
+                nextHandle++;
+            }
+            if (c->val_handle != NULL) {
+                *c->val_handle = valHandle;
+            }
+            svc.chrs.push_back({ c->uuid, valHandle });
+        }
+        gattServices.push_back(svc);
+    }
+    return 0;
+}
+
+int ble_gatts_find_svc(const ble_uuid_t *uuid, uint16_t *out_handle)
+{
+    for (auto &svc : gattServices) {
+        if (ble_uuid_cmp(svc.uuid, uuid) == 0) {
+            *out_handle = svc.handle;
+            return 0;
+        }
+    }
+    return BLE_HS_ENOENT;
+}
+
+int ble_gatts_find_chr(const ble_uuid_t *svc_uuid, const ble_uuid_t *chr_uuid, uint16_t *out_def_handle, uint16_t *out_val_handle)
+{
+    for (auto &svc : gattServices) {
+        if (ble_uuid_cmp(svc.uuid, svc_uuid) != 0) {
+            continue;
+        }
+        for (auto &chr : svc.chrs) {
+            if (ble_uuid_cmp(chr.first, chr_uuid) == 0) {
+                *out_def_handle = chr.second - 1;
+                *out_val_handle = chr.second;
+                return 0;
+            }
+        }
+    }
+    return BLE_HS_ENOENT;
+}
+
+int ble_gatts_notify_custom(uint16_t conn_handle, uint16_t att_handle, struct os_mbuf *om)
+{
+    // Consumes the mbuf like NimBLE, even on failure
+    os_mbuf_free_chain(om);
+    return BLE_HS_ENOTCONN;
+}
+
+int ble_gatts_indicate(uint16_t conn_handle, uint16_t chr_val_handle)
+{
+    return BLE_HS_ENOTCONN;
+}
+
+void ble_svc_gap_init()
+{
+}
+
+void ble_svc_gatt_init()
+{
+}
+
+int ble_svc_gap_device_name_set(const char *name)
+{
+    return 0;
+}
+
+/* NimBLE port */
+
+esp_err_t nimble_port_init()
+{
+    return ESP_OK;
+}
+
+esp_err_t nimble_port_deinit()
+{
+    gattServices.clear();
+    nextHandle = 1;
+    return ESP_OK;
+}
+
+void nimble_port_run()
+{
+}
+
+int nimble_port_stop()
+{
+    return 0;
+}
@@ -0,0 +1,560 @@
+/*
+ * SPDX-FileCopyrightText: 2025 Taneli Leppä
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+#ifndef _HOST_SHIM_H
+#define _HOST_SHIM_H
+
+// Just enough of NimBLE, FreeRTOS, NVS and ESP-IDF to build the server on the
+// host and drive it with ImprovServer::Replay() (see tools/improv_replay.cpp).
+// Constants match ESP-IDF, behaviour doesn't: tasks are created but never run,
+// timers never fire, there are no links, NVS lives in memory and mbedtls calls
+// fail, so replays see no cached PMKs or database hash.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+/* Kconfig defaults for options that are set */
+#if CONFIG_IMPROV_TRACE && !defined(CONFIG_IMPROV_TRACE_BUFFER_SIZE)
+#define CONFIG_IMPROV_TRACE_BUFFER_SIZE 4096
+#endif
+#if CONFIG_IMPROV_BONDING && !defined(CONFIG_IMPROV_BOND_STORE_SIZE)
+#define CONFIG_IMPROV_BOND_STORE_SIZE 4
+#endif
+
+/* esp_err.h, esp_log.h, esp_system.h, esp_timer.h */
+typedef int esp_err_t;
+#define ESP_OK                  0
+#define ESP_FAIL                -1
+#define ESP_ERR_NO_MEM          0x101
+#define ESP_ERR_INVALID_ARG     0x102
+#define ESP_ERR_INVALID_STATE   0x103
+#define ESP_ERR_INVALID_SIZE    0x104
+#define ESP_ERR_NOT_FOUND       0x105
+#define ESP_ERR_NOT_SUPPORTED   0x106
+#define ESP_ERR_TIMEOUT         0x107
+#define ESP_ERR_NVS_NOT_FOUND   0x1102
+#define ESP_ERR_NVS_INVALID_LENGTH 0x110c
+#define ESP_ERROR_CHECK(x)      do { esp_err_t err_ = (x); if (err_ != ESP_OK) abort(); } while (0)
+
+// Logs go to stderr so tools can print their reports on stdout
+extern int host_shim_log_level;
+#define HOST_SHIM_LOG(level, letter, tag, format, ...) \
+    do { if (host_shim_log_level >= (level)) fprintf(stderr, letter " (%s) " format "\n", tag, ##__VA_ARGS__); } while (0)
+#define ESP_LOGE(tag, format, ...) HOST_SHIM_LOG(1, "E", tag, format, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...) HOST_SHIM_LOG(2, "W", tag, format, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...) HOST_SHIM_LOG(3, "I", tag, format, ##__VA_ARGS__)
+#define ESP_LOGD(tag, format, ...) HOST_SHIM_LOG(4, "D", tag, format, ##__VA_ARGS__)
+#define ESP_LOGV(tag, format, ...) HOST_SHIM_LOG(5, "V", tag, format, ##__VA_ARGS__)
+
+uint32_t esp_get_free_heap_size();
+const char *esp_get_idf_version();
+int64_t esp_timer_get_time();
+
+/* FreeRTOS */
+typedef void *TaskHandle_t;
+typedef void *SemaphoreHandle_t;
+typedef void *TimerHandle_t;
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned UBaseType_t;
+typedef void (*TaskFunction_t)(void *);
+typedef void (*TimerCallbackFunction_t)(TimerHandle_t);
+typedef int portMUX_TYPE;
+
+#define pdTRUE                      1
+#define pdFALSE                     0
+#define pdPASS                      pdTRUE
+#define portMAX_DELAY               0xffffffffUL
+#define portTICK_PERIOD_MS          1
+#define pdMS_TO_TICKS(ms)           ((TickType_t)(ms))
+#define tskIDLE_PRIORITY            0
+#define portMUX_INITIALIZER_UNLOCKED 0
+#define portENTER_CRITICAL(mux)     ((void)(mux))
+#define portEXIT_CRITICAL(mux)      ((void)(mux))
+
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack, void *param, UBaseType_t prio, TaskHandle_t *handle);
+void vTaskDelete(TaskHandle_t task);
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t wait);
+BaseType_t xTaskNotifyGive(TaskHandle_t task);
+SemaphoreHandle_t xSemaphoreCreateBinary();
+SemaphoreHandle_t xSemaphoreCreateMutex();
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t wait);
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem);
+TimerHandle_t xTimerCreate(const char *name, TickType_t period, UBaseType_t reload, void *id, TimerCallbackFunction_t fn);
+BaseType_t xTimerReset(TimerHandle_t timer, TickType_t wait);
+BaseType_t xTimerStop(TimerHandle_t timer, TickType_t wait);
+BaseType_t xTimerChangePeriod(TimerHandle_t timer, TickType_t period, TickType_t wait);
+
+/* nvs.h */
+typedef uint32_t nvs_handle_t;
+typedef enum {
+    NVS_READONLY,
+    NVS_READWRITE,
+} nvs_open_mode_t;
+
+esp_err_t nvs_open(const char *ns, nvs_open_mode_t mode, nvs_handle_t *handle);
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char *key, void *value, size_t *len);
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char *key, const void *value, size_t len);
+esp_err_t nvs_erase_key(nvs_handle_t handle, const char *key);
+esp_err_t nvs_commit(nvs_handle_t handle);
+void nvs_close(nvs_handle_t handle);
+
+/* esp_event.h, esp_wifi.h, esp_bt.h */
+typedef const char *esp_event_base_t;
+typedef void (*esp_event_handler_t)(void *arg, esp_event_base_t base, int32_t id, void *data);
+extern esp_event_base_t WIFI_EVENT;
+extern esp_event_base_t IP_EVENT;
+#define WIFI_EVENT_STA_CONNECTED    4
+#define IP_EVENT_STA_GOT_IP         0
+
+typedef struct {
+    uint8_t ssid[32];
+    uint8_t ssid_len;
+    uint8_t bssid[6];
+    uint8_t channel;
+    uint8_t authmode;
+    uint16_t aid;
+} wifi_event_sta_connected_t;
+
+esp_err_t esp_event_handler_register(esp_event_base_t base, int32_t id, esp_event_handler_t handler, void *arg);
+
+typedef enum {
+    ESP_BT_MODE_IDLE = 0,
+    ESP_BT_MODE_BLE,
+    ESP_BT_MODE_CLASSIC_BT,
+    ESP_BT_MODE_BTDM,
+} esp_bt_mode_t;
+
+esp_err_t esp_bt_mem_release(esp_bt_mode_t mode);
+
+/* mbedtls */
+typedef struct mbedtls_cipher_info_t mbedtls_cipher_info_t;
+typedef enum {
+    MBEDTLS_CIPHER_AES_128_ECB = 2,
+} mbedtls_cipher_type_t;
+typedef enum {
+    MBEDTLS_MD_SHA1 = 4,
+} mbedtls_md_type_t;
+typedef struct {
+    int unused;
+} mbedtls_sha256_context;
+
+const mbedtls_cipher_info_t *mbedtls_cipher_info_from_type(mbedtls_cipher_type_t type);
+int mbedtls_cipher_cmac(const mbedtls_cipher_info_t *info, const unsigned char *key, size_t keybits,
+    const unsigned char *input, size_t ilen, unsigned char *output);
+int mbedtls_pkcs5_pbkdf2_hmac_ext(mbedtls_md_type_t md, const unsigned char *password, size_t plen,
+    const unsigned char *salt, size_t slen, unsigned int iterations, uint32_t keylen, unsigned char *output);
+void mbedtls_sha256_init(mbedtls_sha256_context *ctx);
+int mbedtls_sha256_starts(mbedtls_sha256_context *ctx, int is224);
+int mbedtls_sha256_update(mbedtls_sha256_context *ctx, const unsigned char *input, size_t ilen);
+int mbedtls_sha256_finish(mbedtls_sha256_context *ctx, unsigned char *output);
+void mbedtls_sha256_free(mbedtls_sha256_context *ctx);
+int mbedtls_sha256(const unsigned char *input, size_t ilen, unsigned char *output, int is224);
+
+/* NimBLE: UUIDs and mbufs */
+#define BLE_UUID_TYPE_16    16
+#define BLE_UUID_TYPE_32    32
+#define BLE_UUID_TYPE_128   128
+#define BLE_UUID_STR_LEN    37
+
+typedef struct {
+    uint8_t type;
+} ble_uuid_t;
+
+typedef struct {
+    ble_uuid_t u;
+    uint16_t value;
+} ble_uuid16_t;
+
+typedef struct {
+    ble_uuid_t u;
+    uint32_t value;
+} ble_uuid32_t;
+
+typedef struct {
+    ble_uuid_t u;
+    uint8_t value[16];
+} ble_uuid128_t;
+
+#define BLE_UUID16_INIT(uuid16)     { { BLE_UUID_TYPE_16 }, (uuid16) }
+
+uint16_t ble_uuid_u16(const ble_uuid_t *uuid);
+int ble_uuid_cmp(const ble_uuid_t *a, const ble_uuid_t *b);
+char *ble_uuid_to_str(const ble_uuid_t *uuid, char *dst);
+
+// A flat buffer instead of a chain
+struct os_mbuf {
+    uint8_t *om_data;
+    uint16_t om_len;
+};
+
+#define OS_MBUF_PKTLEN(om)  ((om)->om_len)
+
+struct os_mbuf *ble_hs_mbuf_from_flat(const void *buf, uint16_t len);
+int ble_hs_mbuf_to_flat(const struct os_mbuf *om, void *flat, uint16_t max_len, uint16_t *out_copy_len);
+int os_mbuf_append(struct os_mbuf *om, const void *data, uint16_t len);
+int os_mbuf_free_chain(struct os_mbuf *om);
+
+/* NimBLE: host */
+#define BLE_HS_EALREADY             2
+#define BLE_HS_EMSGSIZE             4
+#define BLE_HS_ENOENT               5
+#define BLE_HS_ENOMEM               6
+#define BLE_HS_ENOTCONN             7
+#define BLE_HS_EDONE                14
+#define BLE_HS_CONN_HANDLE_NONE     0xffff
+#define BLE_HS_FOREVER              INT32_MAX
+
+#define BLE_ERR_AUTH_FAIL           0x05
+#define BLE_ERR_REM_USER_CONN_TERM  0x13
+#define BLE_HS_ERR_HCI_BASE         0x200
+#define BLE_HS_HCI_ERR(x)           ((x) ? BLE_HS_ERR_HCI_BASE + (x) : 0)
+
+#define BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN  0x0d
+#define BLE_ATT_ERR_UNLIKELY                0x0e
+#define BLE_ATT_ERR_INSUFFICIENT_RES        0x11
+
+typedef struct {
+    uint8_t type;
+    uint8_t val[6];
+} ble_addr_t;
+
+extern const ble_addr_t ble_addr_any;
+#define BLE_ADDR_ANY (&ble_addr_any)
+#define BLE_OWN_ADDR_PUBLIC 0
+
+int ble_addr_cmp(const ble_addr_t *a, const ble_addr_t *b);
+int ble_hs_id_infer_auto(int privacy, uint8_t *own_addr_type);
+int ble_hs_id_copy_addr(uint8_t id_addr_type, uint8_t *out_id_addr, int *out_is_nrpa);
+
+/* NimBLE: GATT server */
+#define BLE_GATT_SVC_TYPE_PRIMARY   1
+#define BLE_GATT_ACCESS_OP_READ_CHR     0
+#define BLE_GATT_ACCESS_OP_WRITE_CHR    1
+
+#define BLE_GATT_CHR_F_READ         0x0002
+#define BLE_GATT_CHR_F_WRITE        0x0008
+#define BLE_GATT_CHR_F_NOTIFY       0x0010
+#define BLE_GATT_CHR_F_INDICATE     0x0020
+#define BLE_GATT_CHR_F_READ_ENC     0x0200
+#define BLE_GATT_CHR_F_WRITE_ENC    0x1000
+
+typedef uint16_t ble_gatt_chr_flags;
+struct ble_gatt_access_ctxt;
+typedef int ble_gatt_access_fn(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg);
+
+struct ble_gatt_chr_def {
+    const ble_uuid_t *uuid;
+    ble_gatt_access_fn *access_cb;
+    void *arg;
+    struct ble_gatt_dsc_def *descriptors;
+    ble_gatt_chr_flags flags;
+    uint8_t min_key_size;
+    uint16_t *val_handle;
+};
+
+struct ble_gatt_svc_def {
+    uint8_t type;
+    const ble_uuid_t *uuid;
+    const struct ble_gatt_svc_def **includes;
+    const struct ble_gatt_chr_def *characteristics;
+};
+
+struct ble_gatt_access_ctxt {
+    uint8_t op;
+    struct os_mbuf *om;
+    union {
+        const struct ble_gatt_chr_def *chr;
+        const struct ble_gatt_dsc_def *dsc;
+    };
+};
+
+int ble_gatts_count_cfg(const struct ble_gatt_svc_def *defs);
+int ble_gatts_add_svcs(const struct ble_gatt_svc_def *svcs);
+int ble_gatts_find_svc(const ble_uuid_t *uuid, uint16_t *out_handle);
+int ble_gatts_find_chr(const ble_uuid_t *svc_uuid, const ble_uuid_t *chr_uuid, uint16_t *out_def_handle, uint16_t *out_val_handle);
+int ble_gatts_notify_custom(uint16_t conn_handle, uint16_t att_handle, struct os_mbuf *om);
+int ble_gatts_indicate(uint16_t conn_handle, uint16_t chr_val_handle);
+void ble_svc_gap_init();
+void ble_svc_gatt_init();
+int ble_svc_gap_device_name_set(const char *name);
+
+/* NimBLE: GAP */
+#define BLE_GAP_EVENT_CONNECT           0
+#define BLE_GAP_EVENT_DISCONNECT        1
+#define BLE_GAP_EVENT_ADV_COMPLETE      9
+#define BLE_GAP_EVENT_ENC_CHANGE        10
+#define BLE_GAP_EVENT_NOTIFY_TX         13
+#define BLE_GAP_EVENT_SUBSCRIBE         14
+#define BLE_GAP_EVENT_MTU               15
+#define BLE_GAP_EVENT_REPEAT_PAIRING    17
+#define BLE_GAP_REPEAT_PAIRING_RETRY    1
+
+#define BLE_GAP_CONN_MODE_NON   0
+#define BLE_GAP_CONN_MODE_UND   2
+#define BLE_GAP_DISC_MODE_GEN   2
+#define BLE_HCI_ADV_FILT_NONE   0
+#define BLE_HCI_ADV_FILT_CONN   2
+#define BLE_GAP_ADV_ITVL_MS(t)  ((t) * 1000 / 625)
+#define BLE_GAP_ADV_FAST_INTERVAL1_MAX  BLE_GAP_ADV_ITVL_MS(60)
+#define BLE_GAP_ADV_FAST_INTERVAL2_MAX  BLE_GAP_ADV_ITVL_MS(150)
+
+struct ble_gap_sec_state {
+    unsigned encrypted:1;
+    unsigned authenticated:1;
+    unsigned bonded:1;
+    unsigned key_size:5;
+};
+
+struct ble_gap_conn_desc {
+    struct ble_gap_sec_state sec_state;
+    ble_addr_t our_id_addr;
+    ble_addr_t peer_id_addr;
+    ble_addr_t our_ota_addr;
+    ble_addr_t peer_ota_addr;
+    uint16_t conn_handle;
+    uint16_t conn_itvl;
+    uint16_t conn_latency;
+    uint16_t supervision_timeout;
+    uint8_t role;
+    uint8_t master_clock_accuracy;
+};
+
+struct ble_gap_event {
+    uint8_t type;
+    union {
+        struct {
+            int status;
+            uint16_t conn_handle;
+        } connect;
+        struct {
+            int reason;
+            struct ble_gap_conn_desc conn;
+        } disconnect;
+        struct {
+            int reason;
+        } adv_complete;
+        struct {
+            int status;
+            uint16_t conn_handle;
+        } enc_change;
+        struct {
+            int status;
+            uint16_t conn_handle;
+            uint16_t attr_handle;
+            uint8_t indication:1;
+        } notify_tx;
+        struct {
+            uint16_t conn_handle;
+            uint16_t attr_handle;
+            uint8_t reason;
+            uint8_t prev_notify:1;
+            uint8_t cur_notify:1;
+            uint8_t prev_indicate:1;
+            uint8_t cur_indicate:1;
+        } subscribe;
+        struct {
+            uint16_t conn_handle;
+            uint16_t channel_id;
+            uint16_t value;
+        } mtu;
+        struct {
+            uint16_t conn_handle;
+        } repeat_pairing;
+    };
+};
+
+typedef int ble_gap_event_fn(struct ble_gap_event *event, void *arg);
+
+struct ble_gap_adv_params {
+    uint8_t conn_mode;
+    uint8_t disc_mode;
+    uint16_t itvl_min;
+    uint16_t itvl_max;
+    uint8_t channel_map;
+    uint8_t filter_policy;
+    uint8_t high_duty_cycle;
+};
+
+#define BLE_HS_ADV_F_DISC_GEN       0x02
+#define BLE_HS_ADV_F_BREDR_UNSUP    0x04
+#define BLE_HS_ADV_TX_PWR_LVL_AUTO  (-128)
+#define BLE_HS_ADV_MAX_SZ           31
+#define BLE_HS_ADV_SLAVE_ITVL_RANGE_LEN         4
+#define BLE_HS_ADV_PUBLIC_TGT_ADDR_ENTRY_LEN    6
+
+struct ble_hs_adv_fields {
+    uint8_t flags;
+    const ble_uuid16_t *uuids16;
+    uint8_t num_uuids16;
+    unsigned uuids16_is_complete:1;
+    const ble_uuid32_t *uuids32;
+    uint8_t num_uuids32;
+    unsigned uuids32_is_complete:1;
+    const ble_uuid128_t *uuids128;
+    uint8_t num_uuids128;
+    unsigned uuids128_is_complete:1;
+    const uint8_t *name;
+    uint8_t name_len;
+    unsigned name_is_complete:1;
+    int8_t tx_pwr_lvl;
+    unsigned tx_pwr_lvl_is_present:1;
+    const uint8_t *slave_itvl_range;
+    unsigned sm_tk_value_is_present:1;
+    const uint8_t *sm_tk_value;
+    unsigned sm_oob_flag_is_present:1;
+    uint8_t sm_oob_flag;
+    const ble_uuid16_t *sol_uuids16;
+    uint8_t sol_num_uuids16;
+    const ble_uuid32_t *sol_uuids32;
+    uint8_t sol_num_uuids32;
+    const ble_uuid128_t *sol_uuids128;
+    uint8_t sol_num_uuids128;
+    const uint8_t *svc_data_uuid16;
+    uint8_t svc_data_uuid16_len;
+    const uint8_t *public_tgt_addr;
+    uint8_t num_public_tgt_addrs;
+    const uint8_t *random_tgt_addr;
+    uint8_t num_random_tgt_addrs;
+    uint16_t appearance;
+    unsigned appearance_is_present:1;
+    uint16_t adv_itvl;
+    unsigned adv_itvl_is_present:1;
+    const uint8_t *device_addr;
+    unsigned device_addr_is_present:1;
+    uint8_t le_role;
+    unsigned le_role_is_present:1;
+    const uint8_t *svc_data_uuid32;
+    uint8_t svc_data_uuid32_len;
+    const uint8_t *svc_data_uuid128;
+    uint8_t svc_data_uuid128_len;
+    const uint8_t *uri;
+    uint8_t uri_len;
+    const uint8_t *mfg_data;
+    uint8_t mfg_data_len;
+};
+
+int ble_gap_adv_set_fields(const struct ble_hs_adv_fields *fields);
+int ble_gap_adv_start(uint8_t own_addr_type, const ble_addr_t *direct_addr, int32_t duration_ms,
+    const struct ble_gap_adv_params *params, ble_gap_event_fn *cb, void *cb_arg);
+int ble_gap_adv_stop();
+int ble_gap_adv_active();
+int ble_gap_terminate(uint16_t conn_handle, uint8_t reason);
+int ble_gap_conn_find(uint16_t handle, struct ble_gap_conn_desc *out_desc);
+int ble_gap_conn_rssi(uint16_t conn_handle, int8_t *out_rssi);
+int ble_gap_wl_set(const ble_addr_t *addrs, uint8_t white_list_count);
+int ble_gap_security_initiate(uint16_t conn_handle);
+
+/* NimBLE: security manager and key store */
+#define BLE_SM_IO_CAP_NO_IO         0x03
+#define BLE_SM_PAIR_KEY_DIST_ENC    0x01
+#define BLE_SM_PAIR_KEY_DIST_ID     0x02
+
+#define BLE_STORE_OBJ_TYPE_OUR_SEC  1
+#define BLE_STORE_OBJ_TYPE_PEER_SEC 2
+#define BLE_STORE_OBJ_TYPE_CCCD     3
+#define BLE_STORE_EVENT_OVERFLOW    1
+#define BLE_STORE_EVENT_FULL        2
+
+struct ble_store_key_sec {
+    ble_addr_t peer_addr;
+    uint16_t ediv;
+    uint64_t rand_num;
+    unsigned ediv_rand_present:1;
+    uint8_t idx;
+};
+
+struct ble_store_value_sec {
+    ble_addr_t peer_addr;
+    uint8_t key_size;
+    uint16_t ediv;
+    uint64_t rand_num;
+    uint8_t ltk[16];
+    uint8_t ltk_present:1;
+    uint8_t irk[16];
+    uint8_t irk_present:1;
+    uint8_t csrk[16];
+    uint8_t csrk_present:1;
+    unsigned authenticated:1;
+    uint8_t sc:1;
+};
+
+struct ble_store_key_cccd {
+    ble_addr_t peer_addr;
+    uint16_t chr_val_handle;
+    uint8_t idx;
+};
+
+struct ble_store_value_cccd {
+    ble_addr_t peer_addr;
+    uint16_t chr_val_handle;
+    uint16_t flags;
+    unsigned value_changed:1;
+};
+
+union ble_store_key {
+    struct ble_store_key_sec sec;
+    struct ble_store_key_cccd cccd;
+};
+
+union ble_store_value {
+    struct ble_store_value_sec sec;
+    struct ble_store_value_cccd cccd;
+};
+
+struct ble_store_status_event {
+    int event_code;
+    union {
+        struct {
+            int obj_type;
+            const union ble_store_value *value;
+        } overflow;
+        struct {
+            int obj_type;
+            uint16_t conn_handle;
+        } full;
+    };
+};
+
+typedef int ble_store_read_fn(int obj_type, const union ble_store_key *key, union ble_store_value *dst);
+typedef int ble_store_write_fn(int obj_type, const union ble_store_value *val);
+typedef int ble_store_delete_fn(int obj_type, const union ble_store_key *key);
+typedef int ble_store_status_fn(struct ble_store_status_event *event, void *arg);
+
+int ble_store_util_delete_peer(const ble_addr_t *peer_id_addr);
+
+struct ble_hs_cfg {
+    void (*reset_cb)(int reason);
+    void (*sync_cb)();
+    ble_store_read_fn *store_read_cb;
+    ble_store_write_fn *store_write_cb;
+    ble_store_delete_fn *store_delete_cb;
+    ble_store_status_fn *store_status_cb;
+    void *store_status_arg;
+    uint8_t sm_io_cap;
+    unsigned sm_oob_data_flag:1;
+    unsigned sm_bonding:1;
+    unsigned sm_mitm:1;
+    unsigned sm_sc:1;
+    unsigned sm_keypress:1;
+    uint8_t sm_our_key_dist;
+    uint8_t sm_their_key_dist;
+};
+
+extern struct ble_hs_cfg ble_hs_cfg;
+
+/* NimBLE port */
+esp_err_t nimble_port_init();
+esp_err_t nimble_port_deinit();
+void nimble_port_run();
+int nimble_port_stop();
+
+#endif
@@ -0,0 +1,2 @@
+/* Host build of the server, see host_shim.h */
+#include "host_shim.h"
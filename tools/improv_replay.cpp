@@ -0,0 +1,125 @@
+/*
+ * SPDX-FileCopyrightText: 2025 Taneli Leppä
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+// Replays a trace capture (see CONFIG_IMPROV_TRACE) through the server on the
+// host, built against tools/host_shim instead of ESP-IDF. The provisioning
+// callback and WiFi scan results come from the capture, so the same capture
+// always gives the same outcome; the capture is replayed twice to check that.
+// Admission settings can be changed to see how they would have treated the
+// captured sessions. Pass the same CONFIG_IMPROV_* options as the firmware.
+//
+// Build, with IMPROV_SDK pointing at the improv/improv component:
+//   g++ -std=gnu++17 -DCONFIG_IMPROV_TRACE=1 -Itools/host_shim -Isrc -I$IMPROV_SDK/src -o improv_replay tools/improv_replay.cpp
+//       tools/host_shim/host_shim.cpp src/*.cpp $IMPROV_SDK/src/improv.cpp
+// Usage: improv_replay [-v] [-i idle timeout ms] [-r min rssi] capture.bin
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+#include "esp_improv.h"
+
+using namespace improvserver;
+
+static esp_err_t notReplayed(const char *ssid, const char *password, const provision_token_t *token, void *args)
+{
+    // Replays feed the captured results back instead
+    fprintf(stderr, "provisioning callback called during a replay\n");
+    return ESP_FAIL;
+}
+
+static bool sameOutcome(const trace_replay_stats_t *a, const trace_replay_stats_t *b)
+{
+    return a->events == b->events && a->skipped == b->skipped && a->callbacks == b->callbacks &&
+        a->virtualDurationUsecs == b->virtualDurationUsecs && a->finalState == b->finalState &&
+        a->finalError == b->finalError && memcmp(&a->provisioning, &b->provisioning, sizeof(a->provisioning)) == 0 &&
+        memcmp(&a->admission, &b->admission, sizeof(a->admission)) == 0;
+}
+
+int main(int argc, char **argv)
+{
+    admission_policy_t policy = { 0, ADMISSION_RSSI_DISABLED, NULL, 0 };
+    int opt;
+
+    while ((opt = getopt(argc, argv, "vi:r:")) != -1) {
+        switch (opt) {
+        case 'v':
+            host_shim_log_level++;
+            break;
+        case 'i':
+            policy.idleTimeoutMsecs = atoi(optarg);
+            break;
+        case 'r':
+            policy.minRssi = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-v] [-i idle timeout ms] [-r min rssi] capture.bin\n", argv[0]);
+            return 2;
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "usage: %s [-v] [-i idle timeout ms] [-r min rssi] capture.bin\n", argv[0]);
+        return 2;
+    }
+
+    FILE *f = fopen(argv[optind], "rb");
+    if (f == NULL) {
+        perror(argv[optind]);
+        return 1;
+    }
+    std::vector<uint8_t> capture;
+    uint8_t chunk[4096];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+        capture.insert(capture.end(), chunk, chunk + n);
+    }
+    fclose(f);
+
+    ImprovServer server("improv", "host", "replay");
+    if (server.SetAdmissionPolicy(&policy) != ESP_OK || server.Initialize(notReplayed, NULL) != ESP_OK) {
+        fprintf(stderr, "failed to start the server\n");
+        return 1;
+    }
+
+    trace_replay_stats_t stats, again;
+    if (server.Replay(capture.data(), capture.size(), &stats) != ESP_OK) {
+        fprintf(stderr, "%s: not a trace capture\n", argv[optind]);
+        return 1;
+    }
+    const provisioning_stats_t &prov = stats.provisioning;
+    const admission_stats_t &admission = stats.admission;
+    const session_stats_t &sessions = stats.sessions;
+    const bond_stats_t &bonds = stats.bonds;
+
+    printf("%u events, %u callbacks, %u skipped over %.3f ms\n", (unsigned)stats.events, (unsigned)stats.callbacks,
+        (unsigned)stats.skipped, stats.virtualDurationUsecs / 1000.0);
+    printf("final state %u, error %u\n", stats.finalState, stats.finalError);
+    printf("handlers %.3f ms, heap delta %d bytes\n", stats.handlerUsecs / 1000.0, (int)stats.freeHeapDelta);
+    printf("provisioning: %u attempts, %u succeeded, %u failed, %u timed out, %u superseded, %u cancelled\n",
+        (unsigned)prov.attempts, (unsigned)prov.succeeded, (unsigned)prov.failed, (unsigned)prov.timedOut,
+        (unsigned)prov.superseded, (unsigned)prov.cancelled);
+    printf("admission: %u accepted, %u busy, %u idle, %u rssi, %u accept list\n", (unsigned)admission.accepted,
+        (unsigned)admission.busyRejections, (unsigned)admission.idleEvictions, (unsigned)admission.rssiRejections,
+        (unsigned)admission.acceptListRejections);
+    printf("sessions: %u, %u wrote an RPC\n", (unsigned)sessions.sessions, (unsigned)sessions.writeSessions);
+    printf("bonding: %u pairings, %u resumptions, %u failures\n", (unsigned)bonds.pairings,
+        (unsigned)bonds.resumptions, (unsigned)bonds.failures);
+
+    server.Replay(capture.data(), capture.size(), &again);
+    if (!sameOutcome(&stats, &again)) {
+        printf("second replay differs: final state %u, error %u, %u events, %u callbacks\n", again.finalState,
+            again.finalError, (unsigned)again.events, (unsigned)again.callbacks);
+        return 1;
+    }
+    provision_timeline_t timelines[TIMELINE_RING_SIZE];
+    if (server.GetProvisioningStats().attempts != 0 || server.GetSessionStats().sessions != 0 ||
+        server.GetTimelines(timelines, TIMELINE_RING_SIZE) != 0) {
+        printf("replayed sessions leaked into the server's own stats\n");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,143 @@
+/*
+ * SPDX-FileCopyrightText: 2025 Taneli Leppä
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+// Host tool for decoding Improv server trace captures (see CONFIG_IMPROV_TRACE).
+//
+// Build: g++ -std=c++17 -Isrc -o improv_trace_dump tools/improv_trace_dump.cpp src/improv_trace.cpp
+// Usage: improv_trace_dump capture.bin
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <vector>
+#include "improv_trace.h"
+
+using namespace improvserver;
+
+static int32_t getI32(const uint8_t *p)
+{
+    return (int32_t)(p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24));
+}
+
+static const char *chrName(uint8_t chr)
+{
+    switch (chr) {
+    case TRACE_CHR_STATUS:
+        return "status";
+    case TRACE_CHR_ERROR:
+        return "error";
+    case TRACE_CHR_RPC_WRITE:
+        return "rpc_write";
+    case TRACE_CHR_RPC_RESULT:
+        return "rpc_result";
+    case TRACE_CHR_CAPABILITIES:
+        return "capabilities";
+    case TRACE_CHR_MANUFACTURER:
+        return "manufacturer";
+    case TRACE_CHR_MODEL:
+        return "model";
+    case TRACE_CHR_SVC_CHANGED:
+        return "svc_changed";
+    case TRACE_CHR_DB_HASH:
+        return "db_hash";
+    }
+    return "unknown";
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s capture.bin\n", argv[0]);
+        return 2;
+    }
+
+    FILE *f = fopen(argv[1], "rb");
+    if (f == NULL) {
+        perror(argv[1]);
+        return 1;
+    }
+    std::vector<uint8_t> capture;
+    uint8_t chunk[4096];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+        capture.insert(capture.end(), chunk, chunk + n);
+    }
+    fclose(f);
+
+    TraceReader reader(capture.data(), capture.size());
+    if (!reader.Valid()) {
+        fprintf(stderr, "%s: not a trace capture\n", argv[1]);
+        return 1;
+    }
+
+    trace_record_t rec;
+    int64_t first = -1, prev = 0, connectedAt = -1;
+    unsigned records = 0, sessions = 0, rpcSessions = 0, rpcWrites = 0;
+    int64_t connectToRpcTotal = 0;
+    bool rpcSeen = false;
+
+    while (reader.Next(&rec)) {
+        if (first < 0) {
+            first = prev = rec.timestampUsecs;
+        }
+        printf("%10.3f ms (+%8.3f) %-14s conn=%-3u attr=%-3u",
+            (rec.timestampUsecs - first) / 1000.0, (rec.timestampUsecs - prev) / 1000.0,
+            trace_record_type_str(rec.type), rec.connHandle, rec.attrHandle);
+        if (rec.type == TRACE_GATT_ACCESS && rec.payloadLen >= 2) {
+            printf(" %s op=%u len=%u", chrName(rec.payload[0]), rec.payload[1], (unsigned)(rec.payloadLen - 2));
+        } else if (rec.type == TRACE_GAP_CONNECT && rec.payloadLen >= 13) {
+            printf(" peer=%02x:%02x:%02x:%02x:%02x:%02x", rec.payload[10], rec.payload[9], rec.payload[8],
+                rec.payload[7], rec.payload[6], rec.payload[5]);
+            if (rec.payload[12]) {
+                printf(" rssi=%d", (int8_t)rec.payload[11]);
+            }
+        } else if (rec.type == TRACE_PROVISION_SUBMIT && rec.payloadLen >= 4) {
+            printf(" attempt=%u", (unsigned)getI32(rec.payload));
+        } else if (rec.type == TRACE_PROVISION_SCAN && rec.payloadLen >= 8) {
+            printf(" attempt=%u err=%d rssi=", (unsigned)getI32(rec.payload), getI32(rec.payload + 4));
+            for (size_t i = 8; i < rec.payloadLen; i++) {
+                printf(i > 8 ? ",%d" : "%d", (int8_t)rec.payload[i]);
+            }
+        } else if (rec.type == TRACE_PROVISION_RESULT && rec.payloadLen >= 9) {
+            printf(" attempt=%u network=%u err=%d", (unsigned)getI32(rec.payload), rec.payload[4], getI32(rec.payload + 5));
+        } else if (rec.type == TRACE_GAP_ENC_CHANGE && rec.payloadLen >= 4) {
+            printf(" status=%d", getI32(rec.payload));
+            if (rec.payloadLen >= 13) {
+                printf(" encrypted=%u bonded=%u peer=%02x:%02x:%02x:%02x:%02x:%02x", rec.payload[4], rec.payload[5],
+                    rec.payload[12], rec.payload[11], rec.payload[10], rec.payload[9], rec.payload[8], rec.payload[7]);
+            }
+            if (rec.payloadLen >= 14) {
+                printf(" paired=%u", rec.payload[13]);
+            }
+        }
+        printf("\n");
+
+        if (rec.type == TRACE_GAP_CONNECT) {
+            int32_t status = rec.payloadLen >= 4 ? getI32(rec.payload) : 0;
+            if (status == 0) {
+                connectedAt = rec.timestampUsecs;
+                rpcSeen = false;
+                sessions++;
+            }
+        } else if (rec.type == TRACE_GATT_ACCESS && rec.payloadLen >= 2 && rec.payload[0] == TRACE_CHR_RPC_WRITE) {
+            rpcWrites++;
+            if (connectedAt >= 0 && !rpcSeen) {
+                connectToRpcTotal += rec.timestampUsecs - connectedAt;
+                rpcSessions++;
+                rpcSeen = true;
+            }
+        }
+        prev = rec.timestampUsecs;
+        records++;
+    }
+
+    printf("\n%u records over %.3f ms, %u sessions, %u RPC writes\n",
+        records, records > 0 ? (prev - first) / 1000.0 : 0.0, sessions, rpcWrites);
+    if (rpcSessions > 0) {
+        printf("mean connect to first RPC write: %.3f ms\n", connectToRpcTotal / 1000.0 / rpcSessions);
+    }
+    return 0;
+}